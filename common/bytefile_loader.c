@@ -0,0 +1,72 @@
+# include <string.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <stdlib.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include "bytefile_loader.h"
+
+/* stringtab_size, global_area_size and public_symbols_number */
+# define HEADER_SIZE (3 * sizeof(int32_t))
+
+void map_bytefile (const char *fname, mapped_bytefile *bf) {
+  int           fd = open (fname, O_RDONLY);
+  struct stat   st;
+  const int32_t *header;
+  uint64_t      size, publics, strings;
+
+  if (fd < 0) {
+    failure ("%s\n", strerror (errno));
+  }
+
+  if (fstat (fd, &st) != 0) {
+    failure ("%s\n", strerror (errno));
+  }
+
+  size = st.st_size;
+  if (size < HEADER_SIZE || size > INT32_MAX) {
+    failure ("ERROR: %s is not a bytefile\n", fname);
+  }
+
+  bf->mapping_size = size;
+  bf->mapping      = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (bf->mapping == MAP_FAILED) {
+    failure ("%s\n", strerror (errno));
+  }
+
+  header = (const int32_t*) bf->mapping;
+  bf->stringtab_size        = header[0];
+  bf->global_area_size      = header[1];
+  bf->public_symbols_number = header[2];
+
+  if (bf->stringtab_size < 0 || bf->global_area_size < 0 || bf->public_symbols_number < 0) {
+    failure ("ERROR: negative table size in the header of %s\n", fname);
+  }
+
+  publics = (uint64_t) bf->public_symbols_number * 2 * sizeof(int32_t);
+  strings = (uint64_t) bf->stringtab_size;
+  if (HEADER_SIZE + publics + strings > size) {
+    failure ("ERROR: the tables of %s do not fit in the file\n", fname);
+  }
+
+  bf->public_ptr = (const int32_t*) ((const char*) bf->mapping + HEADER_SIZE);
+  bf->string_ptr = (const char*) bf->public_ptr + publics;
+  bf->code_ptr   = bf->string_ptr + strings;
+  bf->code_size  = (int) (size - HEADER_SIZE - publics - strings);
+
+  /* Untouched pages of a large global area are never committed */
+  bf->global_ptr = (int32_t*) calloc (bf->global_area_size + 1, sizeof(int32_t));
+  if (bf->global_ptr == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+}
+
+void unmap_bytefile (mapped_bytefile *bf) {
+  munmap (bf->mapping, bf->mapping_size);
+  free (bf->global_ptr);
+  bf->mapping    = NULL;
+  bf->global_ptr = NULL;
+}
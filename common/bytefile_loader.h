@@ -0,0 +1,32 @@
+# ifndef __BYTEFILE_LOADER_H__
+# define __BYTEFILE_LOADER_H__
+
+# include <stddef.h>
+# include <stdint.h>
+
+/* A bytefile mapped into memory read-only. The tables point into the mapping
+   and nothing is copied, so loading costs the pages that are actually read.
+   Shared by the interpreter (hw2) and the frequency analyzer (hw3). */
+typedef struct {
+  const char    * string_ptr;            /* A pointer to the beginning of the string table */
+  const int32_t * public_ptr;            /* A pointer to the beginning of publics table    */
+  const char    * code_ptr;              /* A pointer to the bytecode itself               */
+  int32_t       * global_ptr;            /* The global area, zero-filled                   */
+  int   code_size;                       /* The size (in bytes) of the bytecode            */
+  int   stringtab_size;                  /* The size (in bytes) of the string table        */
+  int   global_area_size;                /* The size (in words) of global area             */
+  int   public_symbols_number;           /* The number of public symbols                   */
+  void  * mapping;
+  size_t  mapping_size;
+} mapped_bytefile;
+
+/* Maps the bytefile `fname` into `bf`. Fails if the file cannot be read or
+   the sizes in its header do not fit in it. */
+void map_bytefile (const char *fname, mapped_bytefile *bf);
+
+void unmap_bytefile (mapped_bytefile *bf);
+
+/* Provided by the program: prints the message and exits */
+void failure (const char *s, ...) __attribute__ ((noreturn));
+
+# endif // __BYTEFILE_LOADER_H__
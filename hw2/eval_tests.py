@@ -1,11 +1,14 @@
 #!/usr/bin/python3
 import os
 import subprocess
+import sys
 
 base_test_dir = '../../Lama/regression/'
 test_dirs = ['.', 'expressions', 'deep-expressions']
 lama_compiler = 'lamac'
 logs_dir = './logs'
+# With --aot every test is compiled by aotc into an executable instead of being interpreted
+aot = '--aot' in sys.argv[1:]
 tests_total = 0
 tests_success = 0
 
@@ -28,10 +31,14 @@ for test_dir in test_dirs:
         actual_file = os.path.join(logs_dir, test + '.log')
 
         subprocess.run([lama_compiler, '-b', src_file])
-        
+        command = ['./build/interpreter', binary_file]
+        if aot:
+            subprocess.run(['make', '-s', 'native', 'BC=' + binary_file], check=True)
+            command = ['./build/' + test]
+
         with open(input_file, 'r') as inf:
             with open(actual_file, 'w') as ouf:
-                result = subprocess.run(['./build/interpreter', binary_file], stdin=inf, stdout=ouf)
+                result = subprocess.run(command, stdin=inf, stdout=ouf)
 
         if result.returncode != 0:
             print(f'ERROR! Interpreter returned {result.returncode}')
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include "program.h"
+#include "verifier.h"
+
+/* aotc: translates a bytefile into a C++ unit with one function per BEGIN and
+   CBEGIN. The unit includes aot.h and is linked with aot_runtime.o and the
+   Lama runtime into a standalone executable. */
+
+void *__start_custom_data;
+void *__stop_custom_data;
+
+class translator {
+private:
+  program *prog;
+  FILE *out;
+  std::vector<int32_t> depth;
+  std::vector<bool> labels;
+  std::vector<int32_t> tags;         /* String offset -> index in tags[], or -1 */
+  std::vector<int32_t> tag_names;    /* Index in tags[] -> string offset        */
+
+  const char *variable(int32_t l, int32_t index) {
+    static char buffer[64];
+    switch (l) {
+    case LOC_GLOBAL: snprintf(buffer, sizeof(buffer), "globals[%d]", index);  break;
+    case LOC_LOCAL:  snprintf(buffer, sizeof(buffer), "LOCAL(%d)", index);    break;
+    case LOC_ARG:    snprintf(buffer, sizeof(buffer), "ARG(%d)", index);      break;
+    default:         snprintf(buffer, sizeof(buffer), "CAPTURED(%d)", index); break;
+    }
+    return buffer;
+  }
+
+  void emit_string(const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+      unsigned char c = *s;
+      if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\' && c != '?') {
+        fputc(c, out);
+      } else {
+        fprintf(out, "\\%03o", c);
+      }
+    }
+    fputc('"', out);
+  }
+
+  void collect() {
+    std::vector<instruction> &code = prog->code;
+    labels.assign(code.size(), false);
+    tags.assign(prog->bf->code_ptr - prog->bf->string_ptr, -1);
+    for (size_t k = 0; k < code.size(); k++) {
+      const instruction &i = code[k];
+      if (depth[k] >= 0 && (i.op == JMP || i.op == CJMPZ || i.op == CJMPNZ)) {
+        labels[i.ref] = true;
+      }
+      if ((i.op == SEXP || i.op == TAG) && tags[i.ref] < 0) {
+        tags[i.ref] = tag_names.size();
+        tag_names.push_back(i.ref);
+      }
+    }
+  }
+
+  void emit_instruction(const instruction &i) {
+    int32_t l = i.op & 0x0F;
+    switch (i.op & ~0x0F) {
+    case BINOP: {
+      static const char *operators[] = {
+        "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "||"
+      };
+      fprintf(out, "  BINOP(%s);\n", operators[l - 1]);
+      return;
+    }
+
+    case LD:
+      fprintf(out, "  PUSH(%s);\n", variable(l, i.a));
+      return;
+
+    case LDA:
+      fprintf(out, "  PUSH(&%s);\n", variable(l, i.a));
+      return;
+
+    case ST:
+      fprintf(out, "  %s = *sp;\n", variable(l, i.a));
+      return;
+
+    case PATT:
+      if (l == 0) {
+        fprintf(out, "  { void *x = (void*) POP(); void *y = (void*) POP(); PUSH(Bstring_patt(x, y)); }\n");
+      } else {
+        static const char *patterns[] = {
+          nullptr, "Bstring_tag_patt", "Barray_tag_patt", "Bsexp_tag_patt",
+          "Bboxed_patt", "Bunboxed_patt", "Bclosure_tag_patt"
+        };
+        fprintf(out, "  { void *x = (void*) POP(); PUSH(%s(x)); }\n", patterns[l]);
+      }
+      return;
+    }
+
+    switch (i.op) {
+    case CONST:
+      fprintf(out, "  PUSH(%d);\n", i.a);
+      break;
+
+    case STRING:
+      fprintf(out, "  { PUBLISH(); void *s = Bstring(strings + %d); PUSH(s); }\n", i.ref);
+      break;
+
+    case SEXP:
+      fprintf(out, "  { PUBLISH(); void *s = Bsexp_my(AOT_BOX(%d), tags[%d], sp); sp += %d; PUSH(s); }\n",
+              i.a + 1, tags[i.ref], i.a);
+      break;
+
+    case BARRAY:
+      fprintf(out, "  { PUBLISH(); void *a = Barray_my(AOT_BOX(%d), sp); sp += %d; PUSH(a); }\n", i.a, i.a);
+      break;
+
+    case TAG:
+      fprintf(out, "  { void *d = (void*) POP(); PUSH(Btag(d, tags[%d], AOT_BOX(%d))); }\n", tags[i.ref], i.a);
+      break;
+
+    case ARRAY:
+      fprintf(out, "  { void *d = (void*) POP(); PUSH(Barray_patt(d, AOT_BOX(%d))); }\n", i.a);
+      break;
+
+    case STA:
+      fprintf(out, "  { void *v = (void*) POP(); int32_t i = POP(); "
+                   "void *x = (i & 1) ? (void*) POP() : nullptr; PUSH(Bsta(v, i, x)); }\n");
+      break;
+
+    case ELEM:
+      fprintf(out, "  { int32_t i = POP(); void *p = (void*) POP(); PUSH(Belem(p, i)); }\n");
+      break;
+
+    case LENGTH:
+      fprintf(out, "  { void *p = (void*) POP(); PUSH(Llength(p)); }\n");
+      break;
+
+    case LSTRING:
+      fprintf(out, "  { void *p = (void*) POP(); PUBLISH(); PUSH(Lstring(p)); }\n");
+      break;
+
+    case READ:
+      fprintf(out, "  { PUBLISH(); int32_t v = Lread(); PUSH(v); }\n");
+      break;
+
+    case WRITE:
+      fprintf(out, "  { int32_t v = POP(); PUBLISH(); PUSH(Lwrite(v)); }\n");
+      break;
+
+    case DROP:
+      fprintf(out, "  sp++;\n");
+      break;
+
+    case DUP:
+      fprintf(out, "  { int32_t v = *sp; PUSH(v); }\n");
+      break;
+
+    case JMP:
+      fprintf(out, "  goto L%d;\n", i.ref);
+      break;
+
+    case CJMPZ:
+      fprintf(out, "  if (AOT_UNBOX(POP()) == 0) goto L%d;\n", i.ref);
+      break;
+
+    case CJMPNZ:
+      fprintf(out, "  if (AOT_UNBOX(POP()) != 0) goto L%d;\n", i.ref);
+      break;
+
+    case END:
+      fprintf(out, "  EPILOGUE();\n");
+      break;
+
+    case CALL:
+      fprintf(out, "  CALL(f%d, %d);\n", i.ref, i.a);
+      break;
+
+    case CALLC:
+      fprintf(out, "  { aot_function f = (aot_function) Belem((void*) sp[%d], AOT_BOX(0)); CALL(f, %d); }\n",
+              i.a, i.a + 1);
+      break;
+
+    case CLOSURE:
+      fprintf(out, "  {\n");
+      if (i.a > 0) {
+        fprintf(out, "    int32_t binds[] = {");
+        for (int32_t k = 0; k < i.a; k++) {
+          const location &bind = prog->binds[i.b + k];
+          fprintf(out, "%s%s", k > 0 ? ", " : " ", variable(bind.kind, bind.index));
+        }
+        fprintf(out, " };\n");
+      }
+      fprintf(out, "    PUBLISH();\n");
+      fprintf(out, "    PUSH(Bclosure_my(AOT_BOX(%d), (void*) f%d, %s));\n", i.a, i.ref, i.a > 0 ? "binds" : "nullptr");
+      fprintf(out, "  }\n");
+      break;
+
+    case FAIL:
+      fprintf(out, "  PUBLISH();\n  failure((char*) \"Explicitly failed with FAIL %%d %%d\", %d, %d);\n", i.a, i.b);
+      break;
+
+    case STI:
+      fprintf(out, "  PUBLISH();\n  failure((char*) \"STI instruction is deprecated\");\n");
+      break;
+
+    case RET:
+      fprintf(out, "  PUBLISH();\n  failure((char*) \"behaviour of RET is undefined\");\n");
+      break;
+
+    case SWAP:
+      fprintf(out, "  PUBLISH();\n  failure((char*) \"behaviour of SWAP is undefined\");\n");
+      break;
+
+    case STOP:
+      fprintf(out, "  PUBLISH();\n  exit(0);\n");
+      break;
+
+    default:
+      failure("ERROR: cannot translate opcode %d-%d\n", (i.op & 0xF0) >> 4, i.op & 0x0F);
+    }
+  }
+
+  /* Unreachable instructions are not translated: the verifier does not check
+     them, so they may refer to code of other functions */
+  void emit_function(int32_t begin, int32_t end) {
+    const instruction &function = prog->code[begin];
+    fprintf(out, "\nstatic void f%d() {\n", begin);
+    fprintf(out, "  PROLOGUE(%d, %d);\n", function.b, depth[begin] >= 0 ? function.depth : 0);
+    for (int32_t k = begin + 1; k < end; k++) {
+      if (depth[k] < 0) {
+        continue;
+      }
+      if (labels[k]) {
+        fprintf(out, "L%d:\n", k);
+      }
+      emit_instruction(prog->code[k]);
+    }
+    fprintf(out, "  PUBLISH();\n  failure((char*) \"unreachable code\");\n");
+    fprintf(out, "}\n");
+  }
+
+  static bool is_function(const instruction &i) {
+    return i.op == BEGIN || i.op == CBEGIN;
+  }
+
+public:
+  translator(program *prog, FILE *out): prog(prog), out(out) {}
+
+  void translate() {
+    depth = verify(prog);
+    /* verify() leaves the depth of BEGIN itself unset */
+    for (size_t k = 0; k < prog->code.size(); k++) {
+      if (is_function(prog->code[k]) && k + 1 < prog->code.size() && depth[k + 1] >= 0) {
+        depth[k] = 0;
+      }
+    }
+    collect();
+
+    bytefile *bf = prog->bf;
+    fprintf(out, "#include \"aot.h\"\n\n");
+    fprintf(out, "static int32_t globals[%d] __attribute__((unused));\n", bf->get_global_area_size() + 1);
+
+    /* The string table keeps its offsets */
+    fprintf(out, "static char strings[] = \"\"");
+    for (char *s = bf->string_ptr; s < bf->code_ptr; s += strlen(s) + 1) {
+      fprintf(out, "\n  ");
+      emit_string(s);
+      fprintf(out, " \"\\000\"");
+    }
+    fprintf(out, ";\n");
+
+    fprintf(out, "static int32_t tags[%d];\n\n", (int32_t) tag_names.size() + 1);
+
+    std::vector<int32_t> functions;
+    for (size_t k = 0; k < prog->code.size(); k++) {
+      if (is_function(prog->code[k])) {
+        functions.push_back(k);
+        fprintf(out, "static void f%d();\n", (int32_t) k);
+      }
+    }
+    functions.push_back(prog->code.size() - 1);   /* The implicit STOP */
+    for (size_t n = 0; n + 1 < functions.size(); n++) {
+      emit_function(functions[n], functions[n + 1]);
+    }
+
+    fprintf(out, "\nint main() {\n  __init();\n");
+    for (size_t n = 0; n < tag_names.size(); n++) {
+      fprintf(out, "  tags[%d] = LtagHash(strings + %d);\n", (int32_t) n, tag_names[n]);
+    }
+    fprintf(out, "  aot_run(f0);\n  return 0;\n}\n");
+  }
+};
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s file.bc > file.cpp\n", argv[0]);
+    return 1;
+  }
+  bytefile bf(argv[1]);
+  program prog(&bf);
+  translator(&prog, stdout).translate();
+  return 0;
+}
@@ -0,0 +1,22 @@
+#include "aot.h"
+
+const int MAX_STACK_SIZE = 1024 * 1024;
+
+void *__start_custom_data;
+void *__stop_custom_data;
+
+int32_t *aot_sp;
+int32_t *aot_limit;
+
+void aot_run(aot_function main_function) {
+  int32_t *stack = new int32_t[MAX_STACK_SIZE];
+  aot_limit = stack;
+  aot_sp = __gc_stack_top = __gc_stack_bottom = stack + MAX_STACK_SIZE;
+
+  /* main gets two fake arguments, like in the interpreter */
+  int32_t *sp = aot_sp;
+  PUSH(0);
+  PUSH(0);
+  CALL(main_function, 2);
+  PUBLISH();
+}
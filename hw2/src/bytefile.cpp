@@ -1,7 +1,3 @@
-#include <string.h>
-#include <stdio.h>
-#include <errno.h>
-#include <malloc.h>
 #include "bytefile.h"
 
 const char *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
@@ -20,42 +16,19 @@ int bytefile::get_public_offset(int i) {
   return public_ptr[i*2+1];
 }
 
-bytefile::bytefile(char *fname) {
-  FILE *f = fopen (fname, "rb");
-
-  if (f == 0) {
-    failure ("%s\n", strerror (errno));
-  }
-  
-  if (fseek (f, 0, SEEK_END) == -1) {
-    failure ("%s\n", strerror (errno));
-  }
-
-  size_t size = ftell(f) - 3 * sizeof(int32_t);
-  buffer = new char[size];
-
-  if (buffer == 0) {
-    failure ("*** FAILURE: unable to allocate memory.\n");
-  }
-  
-  rewind (f);
-
-  fread(&stringtab_size, sizeof(int), 1, f);
-  fread(&global_area_size, sizeof(int), 1, f);
-  fread(&public_symbols_number, sizeof(int), 1, f);
-  if (size != fread (buffer, 1, size, f)) {
-    failure ("%s\n", strerror (errno));
-  }
-  
-  fclose (f);
+int bytefile::get_global_area_size() {
+  return file.global_area_size;
+}
 
-  string_ptr = buffer + public_symbols_number * 2 * sizeof(int);
-  public_ptr = reinterpret_cast<int*>(buffer);
-  code_ptr   = string_ptr + stringtab_size;
-  global_ptr = new int[global_area_size];
+bytefile::bytefile(char *fname) {
+  map_bytefile(fname, &file);
+  string_ptr = const_cast<char*>(file.string_ptr);
+  public_ptr = const_cast<int*>(file.public_ptr);
+  code_ptr   = const_cast<char*>(file.code_ptr);
+  global_ptr = file.global_ptr;
+  code_size  = file.code_size;
 }
 
 bytefile::~bytefile() {
-  delete[] buffer;
-  delete[] global_ptr;
-}
\ No newline at end of file
+  unmap_bytefile(&file);
+}
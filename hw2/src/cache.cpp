@@ -0,0 +1,220 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include "cache.h"
+
+/* Bump whenever the layout of the cache or of the instructions changes, or a
+   load-time pass changes what it accepts or produces: a cached program is not
+   verified again */
+static const uint32_t VERSION = 2;
+static const char MAGIC[4] = {'L', 'B', 'C', 'C'};
+
+struct cache_header {
+  char     magic[4];
+  uint32_t version;
+  uint32_t config;        /* Load-time passes, see CONFIGURATION        */
+  uint32_t inline_size;
+  uint32_t sizes;         /* Sizes of the records, see record_sizes()   */
+  uint32_t code;          /* Number of instructions                     */
+  uint32_t binds;
+  uint32_t cases;
+  uint32_t lines;
+  uint32_t reserved;
+  uint64_t hash;          /* Hash of the bytefile, see content_hash()   */
+};
+
+/* The load-time passes change the cached code */
+static const uint32_t CONFIGURATION = 0
+#ifdef INLINING
+  | 1 << 0
+#endif
+#ifdef PEEPHOLE
+  | 1 << 1
+#endif
+#ifdef SCALAR_REPLACEMENT
+  | 1 << 2
+#endif
+#ifdef CASE_DISPATCH
+  | 1 << 3
+#endif
+#ifdef TAIL_CALLS
+  | 1 << 4
+#endif
+#if defined(REGISTER_IR) && !defined(JIT)
+  | 1 << 5
+#endif
+#if defined(FUSION) && !defined(JIT)
+  | 1 << 6
+#endif
+#ifdef LAYOUT
+  | 1 << 7
+#endif
+  ;
+
+static uint32_t inline_size() {
+#ifdef INLINING
+  return INLINE_SIZE;
+#else
+  return 0;
+#endif
+}
+
+static uint32_t record_sizes() {
+  return sizeof(instruction) | sizeof(location) << 8 | sizeof(case_entry) << 16 | sizeof(line_info) << 24;
+}
+
+/* FNV-1a over everything the bytefile holds after its header */
+static uint64_t content_hash(bytefile *bf) {
+  const unsigned char *begin = reinterpret_cast<const unsigned char*>(bf->public_ptr);
+  const unsigned char *end   = reinterpret_cast<const unsigned char*>(bf->code_ptr + bf->code_size);
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](uint32_t byte) {
+    hash = (hash ^ byte) * 1099511628211ULL;
+  };
+  for (const unsigned char *p = begin; p < end; p++) {
+    mix(*p);
+  }
+  /* The same bytes may be split differently between the tables */
+  for (uint32_t value : {static_cast<uint32_t>(bf->string_ptr - reinterpret_cast<char*>(bf->public_ptr)),
+                         static_cast<uint32_t>(bf->code_ptr - bf->string_ptr),
+                         static_cast<uint32_t>(bf->get_global_area_size())}) {
+    for (int shift = 0; shift < 32; shift += 8) {
+      mix(value >> shift & 0xFF);
+    }
+  }
+  return hash;
+}
+
+uint64_t program_key(program *prog) {
+  uint64_t key = content_hash(prog->bf);
+  for (uint32_t value : {CONFIGURATION, inline_size(), record_sizes()}) {
+    key = (key ^ value) * 1099511628211ULL;
+  }
+  return key;
+}
+
+/* Returns false if the name is too long */
+static bool cache_name(char (&name)[PATH_MAX], const char *fname, const char *suffix) {
+  int length = snprintf(name, sizeof(name), "%s.cache%s", fname, suffix);
+  return length > 0 && static_cast<size_t>(length) < sizeof(name);
+}
+
+static cache_header make_header(program *prog) {
+  cache_header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version     = VERSION;
+  header.config      = CONFIGURATION;
+  header.inline_size = inline_size();
+  header.sizes       = record_sizes();
+  header.code        = prog->code.size();
+  header.binds       = prog->binds.size();
+  header.cases       = prog->cases.size();
+  header.lines       = prog->lines.size();
+  header.reserved    = 0;
+  header.hash        = content_hash(prog->bf);
+  return header;
+}
+
+static size_t payload_size(const cache_header &header) {
+  return static_cast<size_t>(header.code) * sizeof(instruction)
+       + static_cast<size_t>(header.binds) * sizeof(location)
+       + static_cast<size_t>(header.cases) * sizeof(case_entry)
+       + static_cast<size_t>(header.lines) * sizeof(line_info);
+}
+
+template<typename T>
+static const char *read_records(const char *from, uint32_t count, std::vector<T> &records) {
+  const T *begin = reinterpret_cast<const T*>(from);
+  records.assign(begin, begin + count);
+  return from + static_cast<size_t>(count) * sizeof(T);
+}
+
+template<typename T>
+static bool write_records(int fd, const std::vector<T> &records) {
+  const char *data = reinterpret_cast<const char*>(records.data());
+  size_t size = records.size() * sizeof(T);
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool load_cache(program *prog, const char *fname) {
+  char name[PATH_MAX];
+  if (!cache_name(name, fname, "")) {
+    return false;
+  }
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(cache_header)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  const char *data = static_cast<const char*>(mapped);
+  cache_header header;
+  memcpy(&header, data, sizeof(header));
+  cache_header expected = make_header(prog);
+  bool valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+            && header.version == expected.version
+            && header.config == expected.config
+            && header.inline_size == expected.inline_size
+            && header.sizes == expected.sizes
+            && header.hash == expected.hash
+            && header.code > 0
+            && size - sizeof(header) == payload_size(header);
+  if (valid) {
+    const char *from = data + sizeof(header);
+    from = read_records(from, header.code, prog->code);
+    from = read_records(from, header.binds, prog->binds);
+    from = read_records(from, header.cases, prog->cases);
+    read_records(from, header.lines, prog->lines);
+  }
+  munmap(mapped, size);
+#ifdef STATS
+  fprintf(stderr, "cache: %s\n", valid ? "loaded" : "stale, rebuilt");
+#endif
+  return valid;
+}
+
+void store_cache(program *prog, const char *fname) {
+  /* Written aside and renamed, so a concurrent run sees either no cache or all of it */
+  char name[PATH_MAX], temporary[PATH_MAX], suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d", static_cast<int>(getpid()));
+  if (!cache_name(name, fname, "") || !cache_name(temporary, fname, suffix)) {
+    return;
+  }
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  cache_header header = make_header(prog);
+  std::vector<cache_header> head(1, header);
+  bool written = write_records(fd, head)
+              && write_records(fd, prog->code)
+              && write_records(fd, prog->binds)
+              && write_records(fd, prog->cases)
+              && write_records(fd, prog->lines);
+  close(fd);
+  if (!written || rename(temporary, name) != 0) {
+    unlink(temporary);
+  }
+}
@@ -0,0 +1,139 @@
+#include "case_dispatch.h"
+
+extern "C" {
+  extern int LtagHash (char *s);
+}
+
+/* A case expression tests its scrutinee against the alternatives one by one:
+
+     k:    DUP; TAG t n (or ARRAY n); CJMPz next
+     k+3:  ... the alternative, the scrutinee is still on the stack ...
+     next: DUP; TAG t' n'; CJMPz next'
+           ...
+
+   Every test leaves the stack as it was, so the whole chain can be replaced by
+   one lookup of the tag and the length of the scrutinee that jumps straight to
+   the alternative of the first matching test. The head of the chain becomes
+   CASE; the remaining tests are kept, since other paths may still enter them.
+   A chain ends at the first target that is not such a test, which becomes the
+   default target of CASE. */
+
+static const int32_t MAX_CHAIN = 256;
+
+struct alternative {
+  int32_t tag;
+  int32_t len;
+  int32_t ref;
+};
+
+class chains {
+private:
+  program *prog;
+  std::vector<instruction> &code;
+  std::vector<bool> targets;
+
+  /* DUP; TAG/ARRAY; CJMPz entered only through the DUP */
+  bool is_test(int32_t k) {
+    if (k + 2 >= static_cast<int32_t>(code.size()) || targets[k + 1] || targets[k + 2]) {
+      return false;
+    }
+    return code[k].op == DUP && (code[k + 1].op == TAG || code[k + 1].op == ARRAY)
+                             && code[k + 2].op == CJMPZ;
+  }
+
+  alternative key(int32_t k) {
+    const instruction &test = code[k + 1];
+    alternative result;
+    if (test.op == TAG) {
+      result.tag = LtagHash(prog->bf->get_string(test.ref)) >> 1;
+    } else {
+      result.tag = -1;
+    }
+    result.len = test.a;
+    result.ref = k + 3;
+    return result;
+  }
+
+  /* Open addressing with linear probing; at least half of the slots are empty,
+     so a lookup always stops */
+  int32_t build_table(const std::vector<alternative> &alternatives) {
+    int32_t size = 1;
+    while (size < 2 * static_cast<int32_t>(alternatives.size())) {
+      size *= 2;
+    }
+    int32_t offset = prog->cases.size();
+    case_entry empty;
+    empty.tag = 0;
+    empty.len = -1;
+    empty.ref = 0;
+    prog->cases.resize(offset + size, empty);
+    for (const alternative &alt : alternatives) {
+      uint32_t slot = case_slot(alt.tag, alt.len);
+      while (prog->cases[offset + (slot & (size - 1))].len >= 0) {
+        slot++;
+      }
+      case_entry &e = prog->cases[offset + (slot & (size - 1))];
+      e.tag = alt.tag;
+      e.len = alt.len;
+      e.ref = alt.ref;
+    }
+    return offset;
+  }
+
+public:
+  chains(program *prog): prog(prog), code(prog->code), targets(prog->branch_targets()) {}
+
+  int32_t run() {
+    int32_t size = code.size();
+    std::vector<bool> in_chain(size, false);
+    int32_t compiled = 0;
+
+    for (int32_t k = 0; k < size; k++) {
+      if (in_chain[k] || !is_test(k)) {
+        continue;
+      }
+
+      /* The first test of a key wins, later ones are never reached */
+      std::vector<alternative> alternatives;
+      int32_t next = k;
+      while (is_test(next) && !in_chain[next] &&
+             static_cast<int32_t>(alternatives.size()) < MAX_CHAIN) {
+        in_chain[next] = true;
+        alternative alt = key(next);
+        bool seen = false;
+        for (const alternative &other : alternatives) {
+          seen = seen || (other.tag == alt.tag && other.len == alt.len);
+        }
+        if (!seen) {
+          alternatives.push_back(alt);
+        }
+        next = code[next + 2].ref;
+      }
+
+      /* A single test is as cheap as the lookup */
+      if (alternatives.size() < 2) {
+        continue;
+      }
+
+      int32_t offset = build_table(alternatives);
+      instruction &head = code[k];
+      head.op  = CASE;
+      head.a   = prog->cases.size() - offset - 1;
+      head.b   = offset;
+      head.ref = next;
+      code[k + 1].op = NOP;
+      code[k + 2].op = NOP;
+      compiled++;
+    }
+    return compiled;
+  }
+};
+
+int32_t compile_case_chains(program *prog) {
+  int32_t compiled = chains(prog).run();
+  prog->remove_nops();
+#ifdef STATS
+  fprintf(stderr, "case dispatch: %d chains compiled\n", compiled);
+#endif
+  return compiled;
+}
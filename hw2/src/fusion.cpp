@@ -0,0 +1,203 @@
+#include "fusion.h"
+
+/* A fusable instruction sequence: `match` checks `length` instructions starting
+   at `i`, `fuse` builds the superinstruction that replaces them. To add a new
+   superinstruction, give it an opcode in instruction.h, a handler in
+   interpreter.cpp and an entry in the table below. */
+struct superinstruction {
+  int length;
+  bool (*match)(const instruction *i);
+  instruction (*fuse)(const instruction *i);
+};
+
+static bool is_binop(const instruction &i) {
+  return i.op >= BINOP + 1 && i.op <= BINOP + 13;
+}
+
+/* <, <=, >, >=, ==, != */
+static bool is_comparison(const instruction &i) {
+  return i.op >= BINOP + 6 && i.op <= BINOP + 11;
+}
+
+static bool is_cjmp(const instruction &i) {
+  return i.op == CJMPZ || i.op == CJMPNZ;
+}
+
+static bool is_cmp_cjmp(const instruction &i) {
+  return (i.op & ~0x0F) == CMP_CJMPZ || (i.op & ~0x0F) == CMP_CJMPNZ;
+}
+
+/* LD from a local or an argument, which are both at a fixed offset from fp */
+static bool is_frame_ld(const instruction &i) {
+  return i.op == (LD | LOC_LOCAL) || i.op == (LD | LOC_ARG);
+}
+
+static int32_t frame_offset(const instruction &ld) {
+  if (ld.op == (LD | LOC_LOCAL)) {
+    return -ld.a - 1;
+  }
+  return ld.a + 3;
+}
+
+static int32_t unbox(int32_t value) {
+  return value >> 1;
+}
+
+static instruction make(int32_t op, int32_t a, int32_t b) {
+  instruction result;
+  result.op  = op;
+  result.a   = a;
+  result.b   = b;
+  result.ref = 0;
+  return result;
+}
+
+static bool match_cmp_cjmp(const instruction *i) {
+  return is_comparison(i[0]) && is_cjmp(i[1]);
+}
+
+static instruction fuse_cmp_cjmp(const instruction *i) {
+  instruction result = i[1];
+  result.op = (i[1].op == CJMPZ ? CMP_CJMPZ : CMP_CJMPNZ) | i[0].op;
+  return result;
+}
+
+static bool match_ld_ld_cmp_cjmp(const instruction *i) {
+  return is_frame_ld(i[0]) && is_frame_ld(i[1]) && is_cmp_cjmp(i[2]);
+}
+
+static instruction fuse_ld_ld_cmp_cjmp(const instruction *i) {
+  instruction result = i[2];
+  bool z = (i[2].op & ~0x0F) == CMP_CJMPZ;
+  result.op = (z ? LD_LD_CMP_CJMPZ : LD_LD_CMP_CJMPNZ) | (i[2].op & 0x0F);
+  result.a  = frame_offset(i[0]);
+  result.b  = frame_offset(i[1]);
+  return result;
+}
+
+static bool match_ld_const_cmp_cjmp(const instruction *i) {
+  return is_frame_ld(i[0]) && i[1].op == CONST && is_cmp_cjmp(i[2]);
+}
+
+static instruction fuse_ld_const_cmp_cjmp(const instruction *i) {
+  instruction result = i[2];
+  bool z = (i[2].op & ~0x0F) == CMP_CJMPZ;
+  result.op = (z ? LD_CONST_CMP_CJMPZ : LD_CONST_CMP_CJMPNZ) | (i[2].op & 0x0F);
+  result.a  = frame_offset(i[0]);
+  result.b  = unbox(i[1].a);
+  return result;
+}
+
+static bool match_ld_ld_binop(const instruction *i) {
+  return is_frame_ld(i[0]) && is_frame_ld(i[1]) && is_binop(i[2]);
+}
+
+static instruction fuse_ld_ld_binop(const instruction *i) {
+  return make(LD_LD_BINOP | i[2].op, frame_offset(i[0]), frame_offset(i[1]));
+}
+
+static bool match_ld_const_binop(const instruction *i) {
+  return is_frame_ld(i[0]) && i[1].op == CONST && is_binop(i[2]);
+}
+
+static instruction fuse_ld_const_binop(const instruction *i) {
+  return make(LD_CONST_BINOP | i[2].op, frame_offset(i[0]), unbox(i[1].a));
+}
+
+static bool match_const_binop(const instruction *i) {
+  return i[0].op == CONST && is_binop(i[1]);
+}
+
+static instruction fuse_const_binop(const instruction *i) {
+  return make(CONST_BINOP | i[1].op, unbox(i[0].a), 0);
+}
+
+static bool match_dup_tag(const instruction *i) {
+  return i[0].op == DUP && i[1].op == TAG;
+}
+
+static instruction fuse_dup_tag(const instruction *i) {
+  instruction result = i[1];
+  result.op = DUP_TAG;
+  return result;
+}
+
+static bool match_drop_jmp(const instruction *i) {
+  return i[0].op == DROP && i[1].op == JMP;
+}
+
+static instruction fuse_drop_jmp(const instruction *i) {
+  instruction result = i[1];
+  result.op = DROP_JMP;
+  return result;
+}
+
+static bool match_st_drop(const instruction *i) {
+  return (i[0].op & ~0x0F) == ST && i[1].op == DROP;
+}
+
+static instruction fuse_st_drop(const instruction *i) {
+  instruction result = i[0];
+  result.op = ST_DROP | (i[0].op & 0x0F);
+  return result;
+}
+
+/* Comparisons followed by a conditional jump are fused first, so that the
+   superinstructions below do not split them */
+static const superinstruction compare_branches[] = {
+  { 2, match_cmp_cjmp, fuse_cmp_cjmp },
+};
+
+/* Longer sequences go first */
+static const superinstruction superinstructions[] = {
+  { 3, match_ld_ld_cmp_cjmp,    fuse_ld_ld_cmp_cjmp    },
+  { 3, match_ld_const_cmp_cjmp, fuse_ld_const_cmp_cjmp },
+  { 3, match_ld_ld_binop,       fuse_ld_ld_binop       },
+  { 3, match_ld_const_binop,    fuse_ld_const_binop    },
+  { 2, match_const_binop,       fuse_const_binop       },
+  { 2, match_dup_tag,           fuse_dup_tag           },
+  { 2, match_drop_jmp,          fuse_drop_jmp          },
+  { 2, match_st_drop,           fuse_st_drop           },
+};
+
+template <size_t N>
+static void fuse(program *prog, const superinstruction (&table)[N]) {
+  std::vector<instruction> &code = prog->code;
+  std::vector<bool> targets = prog->branch_targets();
+
+  /* A sequence may only be entered through its first instruction */
+  auto fusable = [&code, &targets](size_t k, int length) {
+    if (k + length > code.size()) {
+      return false;
+    }
+    for (int j = 1; j < length; j++) {
+      if (targets[k + j]) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  size_t k = 0;
+  while (k < code.size()) {
+    int length = 1;
+    for (const superinstruction &s : table) {
+      if (fusable(k, s.length) && s.match(&code[k])) {
+        code[k] = s.fuse(&code[k]);
+        for (int j = 1; j < s.length; j++) {
+          code[k + j].op = NOP;
+        }
+        length = s.length;
+        break;
+      }
+    }
+    k += length;
+  }
+
+  prog->remove_nops();
+}
+
+void fuse_superinstructions(program *prog) {
+  fuse(prog, compare_branches);
+  fuse(prog, superinstructions);
+}
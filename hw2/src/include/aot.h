@@ -0,0 +1,103 @@
+# ifndef __AOT_H__
+# define __AOT_H__
+
+/* Support code for the C++ translations of bytefiles made by aotc (see
+   aot.cpp). Frames have the same layout as in the interpreter:
+
+     fp[0] unused, fp[1] nargs, fp[2] unused, fp[3 + k] arguments from the last
+     one, fp[-1 - k] locals
+
+   Every translated function keeps its own copy of the stack pointer in `sp`.
+   It is stored to aot_sp around calls of other Lama functions and to
+   __gc_stack_bottom before runtime calls that can allocate. */
+
+#include <stdint.h>
+
+extern "C" {
+  #include "runtime.h"
+
+  extern void __init (void);
+  extern int Lread();
+  extern int Lwrite(int);
+  extern int Llength(void*);
+  extern void* Lstring (void *p);
+  extern void* Bstring(void*);
+  extern void* Belem (void *p, int i);
+  extern void* Bsta (void *v, int i, void *x);
+  extern void* Barray_my (int bn, int *data_);
+  extern void* Bsexp_my (int bn, int tag, int *data_);
+  extern int LtagHash (char *s);
+  extern int Btag (void *d, int t, int n);
+  extern int Barray_patt (void *d, int n);
+  extern void* Bclosure_my (int bn, void *entry, int *values);
+  extern int Bstring_patt (void *x, void *y);
+  extern int Bstring_tag_patt (void *x);
+  extern int Barray_tag_patt (void *x);
+  extern int Bsexp_tag_patt (void *x);
+  extern int Bunboxed_patt (void *x);
+  extern int Bboxed_patt (void *x);
+  extern int Bclosure_tag_patt (void *x);
+}
+
+extern int32_t *__gc_stack_top, *__gc_stack_bottom;
+
+typedef void (*aot_function)();
+
+extern int32_t *aot_sp;
+extern int32_t *aot_limit;
+
+/* Runs the translated main function on a fresh stack */
+void aot_run(aot_function main_function);
+
+# define AOT_BOX(x)   ((int32_t) ((x) << 1) | 1)
+# define AOT_UNBOX(x) ((x) >> 1)
+
+# define PUSH(x)  (*--sp = (int32_t) (x))
+# define POP()    (*sp++)
+
+/* Before a runtime call that can run the GC or look at the stack */
+# define PUBLISH() (__gc_stack_bottom = sp)
+
+# define LOCAL(k)    fp[-(k) - 1]
+# define ARG(k)      fp[(k) + 3]
+# define CAPTURED(k) (reinterpret_cast<int32_t*>(fp[fp[1] + 2]))[(k) + 1]
+
+# define PROLOGUE(nlocals, depth)                                   \
+  int32_t *sp = aot_sp;                                             \
+  if (sp - aot_limit < (nlocals) + (depth) + 3) {                   \
+    PUBLISH();                                                      \
+    failure("Stack limit exceeded");                                \
+  }                                                                 \
+  PUSH(0);                                                          \
+  int32_t *fp = sp;                                                 \
+  for (int32_t k = 0; k < (nlocals); k++) {                         \
+    PUSH(AOT_BOX(0));                                               \
+  }
+
+# define EPILOGUE()                                                 \
+  do {                                                              \
+    int32_t rv = POP();                                             \
+    sp = fp + 3 + fp[1];                                            \
+    PUSH(rv);                                                       \
+    aot_sp = sp;                                                    \
+    return;                                                         \
+  } while (0)
+
+/* `nargs` counts the closure of CALLC */
+# define CALL(f, nargs)                                             \
+  do {                                                              \
+    PUSH(0);                                                        \
+    PUSH(nargs);                                                    \
+    aot_sp = sp;                                                    \
+    (f)();                                                          \
+    sp = aot_sp;                                                    \
+  } while (0)
+
+# define BINOP(op)                                                  \
+  do {                                                              \
+    int32_t rhv = AOT_UNBOX(POP());                                 \
+    int32_t lhv = AOT_UNBOX(POP());                                 \
+    PUSH(AOT_BOX(lhv op rhv));                                      \
+  } while (0)
+
+# endif // __AOT_H__
@@ -3,25 +3,25 @@
 
 extern "C" {
   #include "runtime.h"
+  #include "bytefile_loader.h"
 }
 
 extern const char *ops [];
 extern const char *pats[];
 extern const char *lds [];
 
-/* The unpacked representation of bytecode file */
+/* The unpacked representation of bytecode file. The tables are in a read-only
+   mapping of the file (see common/bytefile_loader.h) and must not be written. */
 class bytefile {
 private:
-  int   stringtab_size;          /* The size (in bytes) of the string table        */
-  int   global_area_size;        /* The size (in words) of global area             */
-  int   public_symbols_number;   /* The number of public symbols                   */
-  char  *buffer;
+  mapped_bytefile file;
 
 public:
   char *string_ptr;              /* A pointer to the beginning of the string table */
   int  *public_ptr;              /* A pointer to the beginning of publics table    */
   char *code_ptr;                /* A pointer to the bytecode itself               */
   int  *global_ptr;              /* A pointer to the global area                   */
+  int   code_size;               /* The size (in bytes) of the bytecode            */
 
   bytefile(char *fname);
   ~bytefile();
@@ -29,6 +29,7 @@ public:
   char* get_string (int pos);
   char* get_public_name (int i);
   int get_public_offset (int i);
+  int get_global_area_size ();
 
 };
 # endif // __BYTECODE_LOADER_H__
\ No newline at end of file
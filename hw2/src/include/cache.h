@@ -0,0 +1,24 @@
+# ifndef __CACHE_H__
+# define __CACHE_H__
+#include "program.h"
+
+/* The optimized program is saved next to the bytefile as `<fname>.cache`.
+   The cache is keyed by a hash of the bytefile contents and by the load-time
+   passes the interpreter was built with, so a stale or foreign cache is
+   ignored. It holds the instructions, closure bindings, case tables (with the
+   tag hashes already computed) and lines as they are right before
+   program::link, and the stack depths found by the verifier stay in their
+   BEGINs. */
+
+/* Fills the unlinked and undecoded `prog` from the cache of `fname`; returns
+   false if there is no valid cache */
+bool load_cache(program *prog, const char *fname);
+
+/* Writes the cache of `fname`; a failure to write it is not an error */
+void store_cache(program *prog, const char *fname);
+
+/* Hash of the bytefile of `prog` and of the load-time passes: programs with
+   the same key are translated to the same instructions */
+uint64_t program_key(program *prog);
+
+# endif // __CACHE_H__
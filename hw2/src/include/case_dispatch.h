@@ -0,0 +1,10 @@
+# ifndef __CASE_DISPATCH_H__
+# define __CASE_DISPATCH_H__
+#include "program.h"
+
+/* Replaces chains of DUP; TAG/ARRAY; CJMPz on the same scrutinee with CASE,
+   which reads the tag and the length once and jumps through a hash table.
+   Returns the number of compiled chains. */
+int32_t compile_case_chains(program *prog);
+
+# endif // __CASE_DISPATCH_H__
@@ -0,0 +1,9 @@
+# ifndef __FUSION_H__
+# define __FUSION_H__
+#include "program.h"
+
+/* Fuses comparisons with the following conditional jumps and replaces the
+   hottest instruction sequences with superinstructions */
+void fuse_superinstructions(program *prog);
+
+# endif // __FUSION_H__
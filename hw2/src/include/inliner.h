@@ -0,0 +1,11 @@
+# ifndef __INLINER_H__
+# define __INLINER_H__
+#include "program.h"
+
+/* Replaces CALL of small functions with a copy of their body. `depth` is the
+   operand stack depth before every instruction as returned by verify().
+   Returns the number of inlined calls; the program has to be verified again
+   afterwards, since the callers get new locals and deeper operand stacks. */
+int32_t inline_functions(program *prog, const std::vector<int32_t> &depth, int32_t max_size);
+
+# endif // __INLINER_H__
@@ -0,0 +1,162 @@
+# ifndef __INSTRUCTION_H__
+# define __INSTRUCTION_H__
+
+#include <stdint.h>
+
+/* Opcodes of predecoded instructions. Instructions coming from the bytefile keep
+   their original opcode byte (including the low nibble of BINOP, LD, LDA, ST
+   and PATT), so the dispatch tables are indexed the same way as the bytecode. */
+enum opcode {
+  BINOP   = 0x00,
+  CONST   = 0x10,
+  STRING  = 0x11,
+  SEXP    = 0x12,
+  STI     = 0x13,
+  STA     = 0x14,
+  JMP     = 0x15,
+  END     = 0x16,
+  RET     = 0x17,
+  DROP    = 0x18,
+  DUP     = 0x19,
+  SWAP    = 0x1a,
+  ELEM    = 0x1b,
+  LD      = 0x20,
+  LDA     = 0x30,
+  ST      = 0x40,
+  CJMPZ   = 0x50,
+  CJMPNZ  = 0x51,
+  BEGIN   = 0x52,
+  CBEGIN  = 0x53,
+  CLOSURE = 0x54,
+  CALLC   = 0x55,
+  CALL    = 0x56,
+  TAG     = 0x57,
+  ARRAY   = 0x58,
+  FAIL    = 0x59,
+  LINE    = 0x5a,
+  PATT    = 0x60,
+  READ    = 0x70,
+  WRITE   = 0x71,
+  LENGTH  = 0x72,
+  LSTRING = 0x73,
+  BARRAY  = 0x74,
+  STOP    = 0xF0,
+
+  /* Superinstructions (see fusion.cpp); the low nibble keeps the operator of
+     the fused BINOP or the location of the fused ST */
+  LD_LD_BINOP    = 0x80,
+  CONST_BINOP    = 0x90,
+  LD_CONST_BINOP = 0xA0,
+  DUP_TAG        = 0xB0,
+  DROP_JMP       = 0xB1,
+  ST_DROP        = 0xC0,
+
+  /* Compare-and-branch: BINOP with a comparison followed by CJMPz/CJMPnz,
+     optionally with both operands fused in; the low nibble is the operator */
+  CMP_CJMPZ             = 0xD0,
+  CMP_CJMPNZ            = 0xE0,
+  LD_LD_CMP_CJMPZ       = 0x100,
+  LD_LD_CMP_CJMPNZ      = 0x110,
+  LD_CONST_CMP_CJMPZ    = 0x120,
+  LD_CONST_CMP_CJMPNZ   = 0x130,
+  /* Quickened forms that TAG, SEXP, DUP_TAG and CALLC rewrite themselves into
+     on first execution: the tag hash is kept in `b`, the callee seen by a
+     monomorphic CALLC in `target` */
+  QUICK_SEXP    = 0x140,
+  QUICK_TAG     = 0x141,
+  QUICK_DUP_TAG = 0x142,
+  CALLC_MONO    = 0x143,
+  CALLC_POLY    = 0x144,
+  /* CALL and CALLC right before END (see tailcall.cpp) */
+  TAIL_CALL     = 0x150,
+  TAIL_CALLC    = 0x151,
+  /* Entry into machine code compiled from the following instructions (see
+     jit.cpp); the entry point is kept in `native` */
+  NATIVE        = 0x160,
+  /* Register instructions (see register_ir.cpp): `a` is the destination
+     slot, `b` and `c` the operands; slots are offsets from fp. The low nibble
+     of REG_BINOP and REG_BINOP_CONST is the operator. */
+  REG_MOVE        = 0x170,
+  REG_CONST       = 0x171,
+  REG_BINOP       = 0x180,
+  REG_BINOP_CONST = 0x190,
+  /* Dispatch of a chain of DUP; TAG/ARRAY; CJMPz on the same value (see
+     case_dispatch.cpp): `a` is the mask of the hash table in `cases`, the
+     target is taken if no alternative matches */
+  CASE            = 0x1A0,
+  /* Tuples kept on the stack (see scalar_replacement.cpp): PICK pushes the
+     value `a` slots below the top, SLIDE removes `a` values under the top,
+     DROP_N drops `a` values. BARRAY_END and SEXP_END precede END and return
+     the fields themselves to a CALL_UNPACK. */
+  PICK            = 0x1B0,
+  SLIDE           = 0x1B1,
+  DROP_N          = 0x1B2,
+  CALL_UNPACK     = 0x1B3,
+  BARRAY_END      = 0x1B4,
+  SEXP_END        = 0x1B5,
+
+  /* Placeholder for removed instructions; never reaches the interpreter */
+  NOP     = 0xFF,
+
+  OPCODES_NUMBER = 0x1C0
+};
+
+/* Variable location kinds used by LD, LDA, ST and CLOSURE. Arguments are not
+   reversed on calls, so the index of an argument is counted from the last
+   argument of the enclosing function (see program::decode). */
+enum location_kind {
+  LOC_GLOBAL  = 0,
+  LOC_LOCAL   = 1,
+  LOC_ARG     = 2,
+  LOC_CLOSURE = 3
+};
+
+/* A variable captured by CLOSURE */
+struct location {
+  int32_t kind;
+  int32_t index;
+};
+
+struct instruction;
+
+/* A slot of the hash table of CASE: S-expressions with the tag hash `tag`
+   (arrays if it is -1) and `len` elements go to `target`; empty slots have
+   `len` -1. Before the program is linked, `ref` holds the target index. */
+struct case_entry {
+  int32_t tag;
+  int32_t len;
+  union {
+    int32_t      ref;
+    instruction *target;
+  };
+};
+
+/* Slot of the key in a hash table of CASE, before masking */
+inline uint32_t case_slot(int32_t tag, int32_t len) {
+  uint32_t h = static_cast<uint32_t>(tag) ^ (static_cast<uint32_t>(len) * 0x9E3779B1u);
+  return h ^ (h >> 16);
+}
+
+/* Fixed-width predecoded instruction. Before the program is linked, `ref` holds
+   the index of the target instruction or the offset of the string in the string
+   table, `b` of CLOSURE holds the offset of its captures in program::binds and
+   `b` of CASE the offset of its hash table in program::cases. */
+struct alignas(16) instruction {
+  int32_t op;                    /* Opcode                                         */
+  int32_t a;                     /* First immediate operand                        */
+  union {
+    int32_t      b;              /* Second immediate operand                       */
+    location    *binds;          /* Captured variables of CLOSURE                  */
+    case_entry  *cases;          /* Hash table of CASE                             */
+  };
+  union {
+    int32_t      ref;            /* Unresolved target or string offset             */
+    instruction *target;         /* Target of jumps, calls and CLOSURE             */
+    char        *str;            /* Name of STRING, SEXP and TAG                   */
+    int32_t      depth;          /* Max operand stack depth of BEGIN and CBEGIN    */
+    void        *native;         /* Machine code of NATIVE                         */
+    int32_t      c;              /* Third operand of register instructions         */
+  };
+};
+
+# endif // __INSTRUCTION_H__
@@ -1,76 +1,146 @@
 # ifndef __INTERPRETER_STATE_H__
 # define __INTERPRETER_STATE_H__
 #include "bytefile.h"
+#include "program.h"
 // #include "callstack.h"
 
+/* Interpreter state that run() keeps in locals, so that the compiler can hold
+   it in machine registers. With TOS_CACHING the top of the stack is kept in tos
+   and is not stored in memory: the stack is sp[-1] = tos, sp[0], sp[1], ...
+   flush() makes the whole stack visible in memory. */
+struct registers {
+  instruction *ip;
+  int32_t *sp;
+  int32_t *fp;
+  int32_t *limit;
+  int32_t *globals;
+#ifdef TOS_CACHING
+  int32_t tos;
+#endif
+
+  void push(int32_t value);
+  int32_t pop();
+  int32_t nth(int n);
+  void drop(int n);
+  void fill(int n, int32_t value);
+  void unwind(int32_t *top);
+  int32_t *flush();
+  void reload();
+};
+
 class interpreter {
 private:
   int32_t *&stack_top;
   int32_t *&stack_bottom;
-  int32_t *fp;
 
   bytefile *bf;
+  program *prog;
   // callstack stack;
-  char *ip;
+#ifdef STATS
+  int32_t avoided_allocations;
+#endif
+#ifdef SNAPSHOT
+  const char *image;       /* Bytefile whose image is loaded or saved   */
+  bool snapshot_pending;   /* Save the image at the first READ or WRITE  */
+#endif
 
 private:
-  int32_t *get_stack_bottom();
-  void push(int32_t value);
-  int32_t pop_unchecked();
-  int32_t pop();
-  int32_t nth(int n);
-  void drop(int n);
-  void fill(int n, int32_t value);
-  void reverse(int n);
-  void prologue(int32_t nlocals, int32_t nargs);
-  char *epilogue();
-  int32_t *get_current_closure();
-  int32_t *local(int pos);
-  int32_t *arg(int pos);
-  int32_t *closure_binded(int pos);
-
-  int32_t next_int();
-  char next_char();
-  char* next_str();
-
-  int32_t* global(int32_t ind);
-  int32_t* get_by_location(char l, int32_t value);
-
-  void inst_decode_failure();
-
-  void eval_binop(char l);
-  void eval_const();
-  void eval_end();
-  void eval_drop();
-  void eval_st(char l);
-  void eval_ld(char l);
-  void eval_begin();
-  void eval_cbegin();
-  void eval_read();
-  void eval_write();
-  void eval_line();
-  void eval_jmp();
-  void eval_cjmp_nz();
-  void eval_cjmp_z();
-  void eval_call();
-  void eval_callc();
-  void eval_string();
-  void eval_length();
-  void eval_sta();
-  void eval_elem();
-  void eval_barray();
-  void eval_sexp();
-  void eval_dup();
-  void eval_tag();
-  void eval_lstring();
-  void eval_lda(char l);
-  void eval_array();
-  void eval_fail();
-  void eval_closure();
-  void eval_patt(char l);
+  registers enter();
+  int32_t *save(registers &r);
+#ifdef INLINE_ALLOC
+  int32_t *allocate(int32_t words);
+#endif
+  void restore(registers &r);
+#ifdef SNAPSHOT
+  void resume(registers &r);
+  void take_snapshot(registers &r);
+#endif
+  void prologue(registers &r, instruction *begin);
+  instruction *epilogue(registers &r);
+  instruction *closure_entry(registers &r, int32_t nargs);
+  void call_closure(registers &r, instruction *callee, int32_t nargs);
+  void tail_call(registers &r, instruction *callee, int32_t nargs);
+  void make_sexp(registers &r, int32_t len, int32_t tag);
+  int32_t *get_current_closure(registers &r);
+  int32_t *local(registers &r, int pos);
+  int32_t *arg(registers &r, int pos);
+  int32_t *captured(registers &r, int pos);
+
+  int32_t* global(registers &r, int32_t ind);
+  int32_t* get_by_location(registers &r, char l, int32_t value);
+
+  [[noreturn]] void inst_decode_failure();
+
+  void eval_binop(registers &r, char l);
+  void eval_const(registers &r, instruction *i);
+  void eval_end(registers &r);
+  void eval_drop(registers &r);
+  void eval_st(registers &r, char l, instruction *i);
+  void eval_ld(registers &r, char l, instruction *i);
+  void eval_begin(registers &r, instruction *i);
+  void eval_cbegin(registers &r, instruction *i);
+  void eval_read(registers &r);
+  void eval_write(registers &r);
+  void eval_jmp(registers &r, instruction *i);
+  void eval_cjmp_nz(registers &r, instruction *i);
+  void eval_cjmp_z(registers &r, instruction *i);
+  void eval_call(registers &r, instruction *i);
+  void eval_callc(registers &r, instruction *i);
+  void eval_string(registers &r, instruction *i);
+  void eval_length(registers &r);
+  void eval_sta(registers &r);
+  void eval_elem(registers &r);
+  void eval_barray(registers &r, instruction *i);
+  void eval_sexp(registers &r, instruction *i);
+  void eval_dup(registers &r);
+  void eval_tag(registers &r, instruction *i);
+  void eval_lstring(registers &r);
+  void eval_lda(registers &r, char l, instruction *i);
+  void eval_array(registers &r, instruction *i);
+  void eval_fail(registers &r, instruction *i);
+  void eval_closure(registers &r, instruction *i);
+  void eval_patt(registers &r, char l);
+
+  void eval_ld_ld_binop(registers &r, char l, instruction *i);
+  void eval_const_binop(registers &r, char l, instruction *i);
+  void eval_ld_const_binop(registers &r, char l, instruction *i);
+  void eval_dup_tag(registers &r, instruction *i);
+  void eval_drop_jmp(registers &r, instruction *i);
+  void eval_st_drop(registers &r, char l, instruction *i);
+  void eval_cmp_cjmp_z(registers &r, char l, instruction *i);
+  void eval_cmp_cjmp_nz(registers &r, char l, instruction *i);
+  void eval_ld_ld_cmp_cjmp_z(registers &r, char l, instruction *i);
+  void eval_ld_ld_cmp_cjmp_nz(registers &r, char l, instruction *i);
+  void eval_ld_const_cmp_cjmp_z(registers &r, char l, instruction *i);
+  void eval_ld_const_cmp_cjmp_nz(registers &r, char l, instruction *i);
+
+  void eval_quick_sexp(registers &r, instruction *i);
+  void eval_quick_tag(registers &r, instruction *i);
+  void eval_quick_dup_tag(registers &r, instruction *i);
+  void eval_callc_mono(registers &r, instruction *i);
+  void eval_callc_poly(registers &r, instruction *i);
+  void eval_tail_call(registers &r, instruction *i);
+  void eval_tail_callc(registers &r, instruction *i);
+
+  void eval_native(registers &r, instruction *i);
+
+  void eval_reg_move(registers &r, instruction *i);
+  void eval_reg_const(registers &r, instruction *i);
+  void eval_reg_binop(registers &r, char l, instruction *i);
+  void eval_reg_binop_const(registers &r, char l, instruction *i);
+
+  void eval_case(registers &r, instruction *i);
+
+  bool return_fields(registers &r, int32_t n);
+  void eval_pick(registers &r, instruction *i);
+  void eval_slide(registers &r, instruction *i);
+  void eval_drop_n(registers &r, instruction *i);
+  void eval_barray_end(registers &r, instruction *i);
+  void eval_sexp_end(registers &r, instruction *i);
 
   public:
-  interpreter(bytefile *bf, int32_t *&stack_top, int32_t *&stack_bottom);
+  /* With SNAPSHOT the heap image of `fname` is used, see src/snapshot.cpp */
+  interpreter(program *prog, int32_t *&stack_top, int32_t *&stack_bottom, const char *fname = nullptr);
   ~interpreter();
 
   void run();
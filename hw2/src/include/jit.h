@@ -0,0 +1,23 @@
+# ifndef __JIT_H__
+# define __JIT_H__
+#include "program.h"
+
+/* Interpreter state passed to compiled code: the operand stack in memory, as
+   after registers::flush(). Compiled code updates `sp`. */
+struct native_frame {
+  int32_t *sp;
+  int32_t *fp;
+  int32_t *globals;
+};
+
+/* Runs compiled instructions and returns the next one to interpret */
+typedef instruction* (*native_code)(native_frame *frame);
+
+/* Compiles runs of simple instructions (constants, variables, arithmetic,
+   jumps, ELEM, STA, LENGTH and patterns) into 32-bit x86 code and turns
+   their entries into NATIVE. Calls, allocations and everything else stay
+   with the interpreter. Must run after the program is linked; superinstructions
+   are not compiled. */
+void compile_native(program *prog);
+
+# endif // __JIT_H__
@@ -0,0 +1,11 @@
+# ifndef __LAYOUT_H__
+# define __LAYOUT_H__
+#include "program.h"
+
+/* Reorders the predecoded instructions so that functions with loops or
+   recursion, and functions called from loops, follow the entry function, and
+   straight-line paths that end in FAIL are moved to the end. Must run last,
+   right before the program is linked. */
+void layout_code(program *prog);
+
+# endif // __LAYOUT_H__
@@ -0,0 +1,10 @@
+# ifndef __PEEPHOLE_H__
+# define __PEEPHOLE_H__
+#include "program.h"
+
+/* Folds constant expressions and branches on constants, threads jumps and
+   removes redundant stack traffic. Must run after verify() and before
+   superinstructions are fused. Returns the number of removed instructions. */
+int32_t optimize_peephole(program *prog);
+
+# endif // __PEEPHOLE_H__
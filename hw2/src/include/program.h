@@ -0,0 +1,44 @@
+# ifndef __PROGRAM_H__
+# define __PROGRAM_H__
+
+#include <vector>
+#include "bytefile.h"
+#include "instruction.h"
+
+/* Source line of the instruction with the given index (LINE is not executed) */
+struct line_info {
+  int32_t index;
+  int32_t line;
+};
+
+/* The code section of a bytefile translated into fixed-width instructions */
+class program {
+private:
+  bool linked;
+
+public:
+  bytefile *bf;
+  std::vector<instruction> code;   /* Predecoded instructions                    */
+  std::vector<location>    binds;  /* Captured variables of all CLOSUREs          */
+  std::vector<case_entry>  cases;  /* Hash tables of all CASEs                    */
+  std::vector<line_info>   lines;  /* LINE instructions, sorted by index          */
+
+  /* Without `decode_code` the vectors stay empty until decode() or a cache fills them */
+  program(bytefile *bf, bool decode_code = true);
+
+  void decode();
+
+  std::vector<bool> branch_targets();
+  void remove_nops();
+  void reorder(const std::vector<int32_t> &order);
+
+  void link();
+
+  instruction* entry();
+  int32_t get_line(const instruction *i);
+};
+
+bool has_target(int32_t op);
+bool has_string(int32_t op);
+
+# endif // __PROGRAM_H__
@@ -0,0 +1,11 @@
+# ifndef __REGISTER_IR_H__
+# define __REGISTER_IR_H__
+#include "program.h"
+
+/* Rewrites assignments of simple expressions over locals, arguments and
+   constants (`x := a + b - 2` compiled to LD/CONST/BINOP/ST/DROP) into
+   register instructions that read and write frame slots directly. Must run
+   before fuse_superinstructions. */
+void translate_to_registers(program *prog);
+
+# endif // __REGISTER_IR_H__
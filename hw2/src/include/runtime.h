@@ -16,6 +16,13 @@
 
 # define WORD_SIZE (CHAR_BIT * sizeof(int))
 
-void failure (char *s, ...);
+/* Kinds of heap objects in the low bits of their header, the length is kept
+   in the rest of it */
+# define STRING_TAG  0x00000001
+# define ARRAY_TAG   0x00000003
+# define SEXP_TAG    0x00000005
+# define CLOSURE_TAG 0x00000007
+
+void failure (const char *s, ...) __attribute__ ((noreturn));
 
 # endif
\ No newline at end of file
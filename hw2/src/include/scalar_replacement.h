@@ -0,0 +1,12 @@
+# ifndef __SCALAR_REPLACEMENT_H__
+# define __SCALAR_REPLACEMENT_H__
+#include "program.h"
+
+/* Keeps the fields of arrays and S-expressions that are destructured right
+   after they are built, in the same function or by the caller of the function
+   that returns them, on the stack instead of allocating them. Must run after
+   the peephole pass, which turns jumps to END into END. Returns the number of
+   replaced tuples. */
+int32_t replace_tuples(program *prog);
+
+# endif // __SCALAR_REPLACEMENT_H__
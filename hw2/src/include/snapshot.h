@@ -0,0 +1,29 @@
+# ifndef __SNAPSHOT_H__
+# define __SNAPSHOT_H__
+#include "program.h"
+
+/* A stopped interpreter: it continues with `ip` in the frame `fp`, and its
+   operand stack, flushed to memory, is [bottom, top]. `limit` is the lowest
+   address the stack may grow to. */
+struct machine_state {
+  instruction *ip;
+  int32_t *fp;
+  int32_t *bottom;
+  int32_t *top;
+  int32_t *limit;
+};
+
+/* Saves the heap, the globals and the stack of `state` as `<fname>.image`.
+   Must be called before the program has read or written anything, so that
+   running it from the image is the same as running it from the start. A
+   failure to write the image is not an error. */
+void save_snapshot(program *prog, const char *fname, const machine_state &state);
+
+/* Restores the heap, the globals and the stack from the image of `fname`
+   into the linked `prog` that has not started yet, and sets ip, fp and bottom
+   of `state`; returns false if there is no image for this program. The areas
+   are at other addresses than in the run that saved the image, so pointers
+   into them are relocated. */
+bool load_snapshot(program *prog, const char *fname, machine_state &state);
+
+# endif // __SNAPSHOT_H__
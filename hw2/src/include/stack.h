@@ -0,0 +1,19 @@
+# ifndef __STACK_H__
+# define __STACK_H__
+#include <stdint.h>
+#include <stddef.h>
+
+/* Reserves address space for `words` words of operand stack under a guard page
+   and returns the top of the stack, its highest word. Pages are committed as
+   the stack grows down into them; touching the guard page fails with "Stack
+   limit exceeded", so pushes need no checks. */
+int32_t *reserve_stack(size_t words);
+
+/* Calls body(argument). If the stack runs into its guard page meanwhile, the
+   call is abandoned and the overflow is reported with failure(), outside of
+   the signal handler. */
+void run_guarded(void (*body)(void*), void *argument);
+
+void release_stack();
+
+# endif // __STACK_H__
@@ -0,0 +1,9 @@
+# ifndef __TAILCALL_H__
+# define __TAILCALL_H__
+#include "program.h"
+
+/* Turns CALL and CALLC immediately followed by END into TAIL_CALL and
+   TAIL_CALLC, which reuse the frame of the calling function */
+void mark_tail_calls(program *prog);
+
+# endif // __TAILCALL_H__
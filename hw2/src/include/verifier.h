@@ -0,0 +1,14 @@
+# ifndef __VERIFIER_H__
+# define __VERIFIER_H__
+#include "program.h"
+
+/* Checks every function reachable from the entry point, CALL and CLOSURE:
+   operand stack depth is the same on all paths to an instruction, no
+   instruction pops more than its function has pushed, and variable indices are
+   in range. Stores the maximum operand stack depth of each function in the
+   `depth` of its BEGIN/CBEGIN. Fails on malformed bytecode. Must run before
+   superinstructions are fused. Returns the operand stack depth before every
+   instruction, -1 for unreachable ones. */
+std::vector<int32_t> verify(program *prog);
+
+# endif // __VERIFIER_H__
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include "inliner.h"
+
+/* A call is inlined by storing the arguments into locals of the caller and
+   running a copy of the callee body in the caller frame:
+
+     ST L x(n-1); DROP; ... ST L x0; DROP    the last argument is on top
+     CONST 0; ST L y0; DROP; ...             callee locals start as box(0)
+     <body>                                  A and L remapped to x and y,
+                                             END -> JMP past the copy
+
+   Only functions without calls, closures and captured variables are inlined,
+   so a copy never recurses and never needs the frame of the callee. All
+   inlined calls in one function share the same extra locals: their copies
+   never run at the same time. */
+
+static bool is_function(const instruction &i) {
+  return i.op == BEGIN || i.op == CBEGIN;
+}
+
+static instruction make(int32_t op, int32_t a) {
+  instruction result;
+  result.op  = op;
+  result.a   = a;
+  result.b   = 0;
+  result.ref = 0;
+  return result;
+}
+
+/* Body of the function at `begin` is [begin + 1, end); END that closes it is
+   not copied, the copy falls through instead */
+static int32_t copy_length(program *prog, int32_t begin, int32_t end) {
+  return prog->code[end - 1].op == END ? end - begin - 2 : end - begin - 1;
+}
+
+static bool can_inline(program *prog, const std::vector<int32_t> &depth,
+                       int32_t begin, int32_t end, int32_t max_size) {
+  if (prog->code[begin].op != BEGIN || end - begin - 1 > max_size) {
+    return false;
+  }
+  for (int32_t k = begin + 1; k < end; k++) {
+    const instruction &i = prog->code[k];
+    switch (i.op & ~0x0F) {
+    case LD:
+    case LDA:
+    case ST:
+      if ((i.op & 0x0F) == LOC_CLOSURE) {
+        return false;
+      }
+      continue;
+    }
+    switch (i.op) {
+    case CALL:
+    case CALLC:
+    case CLOSURE:
+    case STOP:
+      return false;
+
+    /* The result has to be the only value left, as after a CALL */
+    case END:
+      if (depth[k] != 1 && depth[k] != -1) {
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+int32_t inline_functions(program *prog, const std::vector<int32_t> &depth, int32_t max_size) {
+  std::vector<instruction> &code = prog->code;
+  int32_t size = code.size();
+
+  /* The implicit STOP at the end belongs to no function */
+  std::vector<int32_t> body_end(size, size - 1);
+  for (int32_t k = size - 2, next = size - 1; k >= 0; k--) {
+    if (is_function(code[k])) {
+      body_end[k] = next;
+      next = k;
+    }
+  }
+
+  std::vector<bool> inlinable(size, false);
+  for (int32_t k = 0; k < size; k++) {
+    if (is_function(code[k])) {
+      inlinable[k] = can_inline(prog, depth, k, body_end[k], max_size);
+    }
+  }
+
+  auto inlined = [&code, &inlinable](const instruction &i) {
+    return i.op == CALL && inlinable[i.ref] && code[i.ref].a == i.a;
+  };
+  auto prefix_length = [](const instruction &callee) {
+    return 2 * callee.a + 3 * callee.b;
+  };
+
+  /* Layout of the result and extra locals of every caller */
+  std::vector<int32_t> new_index(size + 1);
+  std::vector<int32_t> extra(size, 0);
+  int32_t count = 0;
+  int32_t n = 0;
+  for (int32_t k = 0, caller = 0; k < size; k++) {
+    new_index[k] = n;
+    if (is_function(code[k])) {
+      caller = k;
+    }
+    if (!inlined(code[k])) {
+      n++;
+      continue;
+    }
+    const instruction &callee = code[code[k].ref];
+    n += prefix_length(callee) + copy_length(prog, code[k].ref, body_end[code[k].ref]);
+    extra[caller] = std::max(extra[caller], callee.a + callee.b);
+    count++;
+  }
+  new_index[size] = n;
+
+  if (count == 0) {
+    return 0;
+  }
+
+  std::vector<instruction> result;
+  result.reserve(n);
+  for (int32_t k = 0, base = 0; k < size; k++) {
+    const instruction &i = code[k];
+    if (!inlined(i)) {
+      instruction copy = i;
+      if (is_function(i)) {
+        base = i.b;
+        copy.b += extra[k];
+      }
+      if (has_target(i.op)) {
+        copy.ref = new_index[i.ref];
+      }
+      result.push_back(copy);
+      continue;
+    }
+
+    int32_t begin  = i.ref;
+    int32_t end    = body_end[begin];
+    int32_t nargs  = code[begin].a;
+    int32_t locals = code[begin].b;
+    int32_t body   = result.size() + prefix_length(code[begin]);
+    int32_t after  = body + copy_length(prog, begin, end);
+
+    /* Argument indices are already counted from the last argument */
+    for (int32_t arg = 0; arg < nargs; arg++) {
+      result.push_back(make(ST | LOC_LOCAL, base + arg));
+      result.push_back(make(DROP, 0));
+    }
+    for (int32_t local = 0; local < locals; local++) {
+      result.push_back(make(CONST, 1));
+      result.push_back(make(ST | LOC_LOCAL, base + nargs + local));
+      result.push_back(make(DROP, 0));
+    }
+
+    for (int32_t m = begin + 1; m < end; m++) {
+      instruction copy = code[m];
+      switch (copy.op & ~0x0F) {
+      case LD:
+      case LDA:
+      case ST:
+        if ((copy.op & 0x0F) == LOC_ARG) {
+          copy.op = (copy.op & ~0x0F) | LOC_LOCAL;
+          copy.a  = base + copy.a;
+        } else if ((copy.op & 0x0F) == LOC_LOCAL) {
+          copy.a  = base + nargs + copy.a;
+        }
+        break;
+      }
+      if (copy.op == END) {
+        if (m == end - 1) {
+          break;
+        }
+        copy = make(JMP, 0);
+        copy.ref = after;
+      } else if (has_target(copy.op)) {
+        copy.ref = body + copy.ref - begin - 1;
+      }
+      result.push_back(copy);
+    }
+  }
+
+  code = std::move(result);
+  for (line_info &info : prog->lines) {
+    info.index = new_index[info.index];
+  }
+  return count;
+}
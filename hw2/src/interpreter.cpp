@@ -1,4 +1,7 @@
 #include "interpreter.h"
+#include "jit.h"
+#include "stack.h"
+#include "snapshot.h"
 #include <iostream>
 
 extern "C" {
@@ -12,11 +15,13 @@ extern "C" {
   extern void* Bsta (void *v, int i, void *x);
   extern void* Barray_my (int bn, int *data_);
   extern void* Bsexp_my (int bn, int tag, int *data_);
+  extern void* Bsexp_nullary (int tag);
+  extern void* Barray_empty ();
   extern int LtagHash (char *s);
   extern int Btag (void *d, int t, int n);
   extern int Barray_patt (void *d, int n);
+  extern int Bcase_shape (void *d, int *tag);
   extern void* Bclosure_my (int bn, void *entry, int *values);
-  extern void* Belem_link (void *p, int i);
   extern int Bstring_patt (void *x, void *y);
   extern int Bstring_tag_patt (void *x);
   extern int Barray_tag_patt (void *x);
@@ -24,22 +29,53 @@ extern "C" {
   extern int Bunboxed_patt (void *x);
   extern int Bboxed_patt (void *x);
   extern int Bclosure_tag_patt (void *x);
+  extern size_t **__gc_heap_current;
+  extern size_t **__gc_heap_end;
 }
 
-const int MAX_STACK_SIZE = 1024 * 1024;
-
-interpreter::interpreter(bytefile *bf, int32_t *&stack_top, int32_t *&stack_bottom):
-  bf(bf), stack_top(stack_top), stack_bottom(stack_bottom), ip(bf->code_ptr) {
-
-  fp = stack_bottom = stack_top = (new int[MAX_STACK_SIZE]) + MAX_STACK_SIZE;
-  push(0); // fake argv
-  push(0); // fake argc
-  push(2);
-}
-
-
-int32_t* interpreter::get_stack_bottom() {
-  return stack_bottom;
+#ifndef STACK_SIZE
+#define STACK_SIZE (1024 * 1024)
+#endif
+
+const int MAX_STACK_SIZE = STACK_SIZE;
+
+/* Stack words of a frame besides locals and operands: the saved fp, the return
+   address and nargs of a call from the frame and, with TOS_CACHING, the dead
+   slot above the locals */
+#ifdef TOS_CACHING
+const int FRAME_WORDS = 4;
+#else
+const int FRAME_WORDS = 3;
+#endif
+
+interpreter::interpreter(program *prog, int32_t *&stack_top, int32_t *&stack_bottom, const char *fname):
+  stack_top(stack_top), stack_bottom(stack_bottom), bf(prog->bf), prog(prog) {
+#ifdef STATS
+  avoided_allocations = 0;
+#endif
+#ifdef SNAPSHOT
+  image = fname;
+  snapshot_pending = false;
+#else
+  (void) fname;
+#endif
+
+  // stack_top is the highest word of the stack
+#ifdef STACK_GUARD
+  stack_bottom = stack_top = reserve_stack(MAX_STACK_SIZE);
+#else
+  stack_bottom = stack_top = (new int[MAX_STACK_SIZE + 1]) + MAX_STACK_SIZE;
+#endif
+  // main is entered as if called from a frame below stack_top: its arguments,
+  // return address and nargs, as CALL leaves them, and above them the slot
+  // where the epilogue puts its return value. Returning from main (or a tail
+  // call out of it) stays inside the stack, and the null return address stops
+  // run().
+  *(--stack_bottom) = 0; // return value of main
+  *(--stack_bottom) = 0; // fake argv
+  *(--stack_bottom) = 0; // fake argc
+  *(--stack_bottom) = 0; // return address
+  *(--stack_bottom) = 2; // nargs
 }
 
 int32_t box(int32_t value) {
@@ -54,110 +90,230 @@ bool is_boxed(int32_t value) {
   return value & 1;
 }
 
-void interpreter::push(int32_t value) {
-  if (stack_bottom == stack_top - MAX_STACK_SIZE) {
-    failure("Stack limit exceeded");
-  }
-  *(--stack_bottom) = value;
+/* Handlers and stack operations are inlined into run(), so that the registers
+   structure is never spilled to memory between instructions */
+# define HANDLER inline __attribute__((always_inline))
+
+#ifdef TOS_CACHING
+
+HANDLER void registers::push(int32_t value) {
+  *(--sp) = tos;
+  tos = value;
+}
+
+HANDLER int32_t registers::pop() {
+  int32_t value = tos;
+  tos = *(sp++);
+  return value;
 }
 
-int32_t interpreter::pop_unchecked() {
-  return *(stack_bottom++);
+HANDLER int32_t registers::nth(int n) {
+  return n == 0 ? tos : sp[n - 1];
 }
 
-int32_t interpreter::pop() {
-  if (stack_bottom >= fp) {
-    failure("Illegal pop occured");
+HANDLER void registers::drop(int n) {
+  if (n > 0) {
+    sp += n;
+    tos = sp[-1];
   }
-  return pop_unchecked();
 }
 
-int32_t interpreter::nth(int n) {
-  return stack_bottom[n];
+HANDLER void registers::unwind(int32_t *top) {
+  sp = top + 1;
+  tos = *top;
 }
 
-void interpreter::drop(int n) {
-  stack_bottom += n;
+HANDLER int32_t* registers::flush() {
+  sp[-1] = tos;
+  return sp - 1;
 }
 
-void interpreter::fill(int n, int32_t value) {
+HANDLER void registers::reload() {
+  tos = sp[-1];
+}
+
+#else
+
+HANDLER void registers::push(int32_t value) {
+  *(--sp) = value;
+}
+
+HANDLER int32_t registers::pop() {
+  return *(sp++);
+}
+
+HANDLER int32_t registers::nth(int n) {
+  return sp[n];
+}
+
+HANDLER void registers::drop(int n) {
+  sp += n;
+}
+
+HANDLER void registers::unwind(int32_t *top) {
+  sp = top;
+}
+
+HANDLER int32_t* registers::flush() {
+  return sp;
+}
+
+HANDLER void registers::reload() {
+}
+
+#endif // TOS_CACHING
+
+HANDLER void registers::fill(int n, int32_t value) {
   for (int i = 0; i < n; i++) {
     push(value);
   }
 }
 
-void interpreter::reverse(int n) {
-  int32_t *st = stack_bottom; // Point to last element
-  int32_t *first_arg = st + n - 1; // Points to first argument
-  while (st < first_arg) {
-    std::swap(*(st++), *(first_arg--));
+/* Loads the registers of run() from the stack built by the constructor */
+registers interpreter::enter() {
+  registers r;
+  r.ip = prog->entry();
+  r.fp = stack_top;
+  r.limit = stack_top - MAX_STACK_SIZE;
+  r.globals = bf->global_ptr;
+  r.unwind(stack_bottom);
+  return r;
+}
+
+#ifdef INLINE_ALLOC
+/* Bump-pointer allocation of `words` words in the from-space, as alloc() in
+   runtime.c does; nullptr if they do not fit, then the object is left to the
+   runtime, which collects garbage first */
+HANDLER int32_t* interpreter::allocate(int32_t words) {
+  size_t *obj = *__gc_heap_current;
+  if (!(obj + words < *__gc_heap_end)) {
+    return nullptr;
   }
+  *__gc_heap_current = obj + words;
+  return reinterpret_cast<int32_t*>(obj);
 }
+#endif
 
-void interpreter::prologue(int32_t nlocals, int32_t nargs) {
-  push(reinterpret_cast<int32_t>(fp));
-  fp = stack_bottom;
-  fill(nlocals, box(0));
+/* Publishes the stack to the runtime before a call that can run the GC or
+   otherwise look at the stack */
+HANDLER int32_t* interpreter::save(registers &r) {
+  return stack_bottom = r.flush();
 }
 
-char* interpreter::epilogue() {
-  int32_t rv = pop();
-  stack_bottom = fp;
-  fp = reinterpret_cast<int32_t*>(pop_unchecked());
-  int32_t nargs = pop();
-  char *ra = reinterpret_cast<char*>(pop());
-  drop(nargs);
-  push(rv);
-  return ra;
+/* Picks up the values the GC may have moved during the call */
+HANDLER void interpreter::restore(registers &r) {
+  r.reload();
 }
 
-int32_t* interpreter::get_current_closure() {
-  int32_t nargs = *(fp + 1);
-  return reinterpret_cast<int32_t*>(*arg(nargs - 1));
+#ifdef SNAPSHOT
+/* Nothing a program does before its first READ or WRITE depends on the world
+   outside, so that is where the image is taken and where a later run resumes:
+   these runs skip the initialization of the globals */
+void interpreter::resume(registers &r) {
+  machine_state state;
+  state.top   = stack_top;
+  state.limit = r.limit;
+  if (image == nullptr) {
+    return;
+  }
+  if (!load_snapshot(prog, image, state)) {
+    snapshot_pending = true;
+    return;
+  }
+  r.ip = state.ip;
+  r.fp = state.fp;
+  r.unwind(state.bottom);
+  stack_bottom = state.bottom;
 }
 
-int32_t* interpreter::local(int pos) {
-  return fp - pos - 1;
+/* Called by READ and WRITE before they do anything */
+__attribute__((noinline)) void interpreter::take_snapshot(registers &r) {
+  machine_state state;
+  state.ip     = r.ip - 1;
+  state.fp     = r.fp;
+  state.bottom = save(r);
+  state.top    = stack_top;
+  state.limit  = r.limit;
+  save_snapshot(prog, image, state);
+  snapshot_pending = false;
+}
+#endif
+
+/* The verifier bounds the operand stack of every function, so this is the only
+   stack overflow check: pushes and pops in the handlers are unchecked. With
+   STACK_GUARD there is none, the stack grows word by word into its guard page */
+HANDLER void interpreter::prologue(registers &r, instruction *begin) {
+  int32_t nlocals = begin->b;
+#ifndef STACK_GUARD
+  if (r.sp - r.limit < nlocals + begin->depth + FRAME_WORDS) {
+    failure("Stack limit exceeded");
+  }
+#endif
+  r.push(reinterpret_cast<int32_t>(r.fp));
+  r.fp = r.flush();
+  r.fill(nlocals, box(0));
+#ifdef TOS_CACHING
+  // Locals are addressed through fp, so none of them may stay in tos
+  r.push(box(0));
+#endif
 }
 
-int32_t* interpreter::arg(int pos) {
-  return fp + pos + 3;
+HANDLER instruction* interpreter::epilogue(registers &r) {
+  int32_t rv = r.pop();
+  int32_t *fp = r.fp;
+  int32_t nargs = fp[1];
+  instruction *ra = reinterpret_cast<instruction*>(fp[2]);
+  r.fp = reinterpret_cast<int32_t*>(fp[0]);
+  r.unwind(fp + 3 + nargs);
+  r.push(rv);
+  return ra;
 }
 
-int32_t* interpreter::closure_binded(int pos) {
-  int32_t *closure = get_current_closure();
-  return reinterpret_cast<int32_t*>(Belem_link(closure, box(pos + 1)));
+/* CALLC pushes the closure before the arguments, so it is the deepest one */
+HANDLER int32_t* interpreter::get_current_closure(registers &r) {
+  int32_t nargs = *(r.fp + 1);
+  return reinterpret_cast<int32_t*>(*arg(r, nargs - 1));
 }
 
-interpreter::~interpreter() {
-  delete[] (stack_top - MAX_STACK_SIZE);
+HANDLER int32_t* interpreter::local(registers &r, int pos) {
+  return r.fp - pos - 1;
 }
 
-int32_t interpreter::next_int() {
-  int32_t result = *reinterpret_cast<int32_t*>(ip);
-  ip += 4;
-  return result;
+HANDLER int32_t* interpreter::arg(registers &r, int pos) {
+  return r.fp + pos + 3;
 }
 
-char interpreter::next_char() {
-  return *ip++;
+/* A closure points to its entry point followed by the captured values. The
+   verifier bounds the index by the number of values the CLOSURE sites of the
+   function bind, and a closure of the function comes from one of them, so
+   there is no need for the checks of Belem_link */
+HANDLER int32_t* interpreter::captured(registers &r, int pos) {
+  return get_current_closure(r) + pos + 1;
 }
 
-char* interpreter::next_str() {
-  int32_t pos = next_int();
-  return bf->get_string(pos);
+interpreter::~interpreter() {
+#ifdef STATS
+  fprintf(stderr, "scalar replacement: %d allocations avoided\n", avoided_allocations);
+#endif
+#ifdef STACK_GUARD
+  release_stack();
+#else
+  delete[] (stack_top - MAX_STACK_SIZE);
+#endif
 }
 
-int32_t* interpreter::global(int32_t pos) {
-  return bf->global_ptr + pos;
+HANDLER int32_t* interpreter::global(registers &r, int32_t pos) {
+  return r.globals + pos;
 }
 
-int32_t* interpreter::get_by_location(char l, int32_t value) {
+/* Handlers are instantiated for every location kind (see run()), so the switch
+   folds away */
+HANDLER int32_t* interpreter::get_by_location(registers &r, char l, int32_t value) {
   switch (l) {
-    case 0: return global(value);
-    case 1: return local(value);
-    case 2: return arg(value);
-    case 3: return closure_binded(value);
+    case LOC_GLOBAL:  return global(r, value);
+    case LOC_LOCAL:   return local(r, value);
+    case LOC_ARG:     return arg(r, value);
+    case LOC_CLOSURE: return captured(r, value);
     default: inst_decode_failure();
   }
 }
@@ -166,232 +322,445 @@ void interpreter::inst_decode_failure() {
   failure("ERROR: invalide opcode");
 }
 
-void interpreter::eval_binop(char l) {
-  int32_t rhv = unbox(pop());
-  int32_t lhv = unbox(pop());
-  int32_t result;
+HANDLER int32_t binop(char l, int32_t lhv, int32_t rhv) {
   switch (l) {
     case 1:
-      result = lhv + rhv;
-      break;
+      return lhv + rhv;
     case 2:
-      result = lhv - rhv;
-      break;
+      return lhv - rhv;
     case 3:
-      result = lhv * rhv;
-      break;
+      return lhv * rhv;
     case 4:
-      result = lhv / rhv;
-      break;
+      return lhv / rhv;
     case 5:
-      result = lhv % rhv;
-      break;
+      return lhv % rhv;
     case 6:
-      result = lhv < rhv;
-      break;
+      return lhv < rhv;
     case 7:
-      result = lhv <= rhv;
-      break;
+      return lhv <= rhv;
     case 8:
-      result = lhv > rhv;
-      break;
+      return lhv > rhv;
     case 9:
-      result = lhv >= rhv;
-      break;
+      return lhv >= rhv;
     case 10:
-      result = lhv == rhv;
-      break;
+      return lhv == rhv;
     case 11:
-      result = lhv != rhv;
-      break;
+      return lhv != rhv;
     case 12:
-      result = lhv && rhv;
-      break;
+      return lhv && rhv;
     case 13:
-      result = lhv || rhv;
-      break;
+      return lhv || rhv;
     default:
       failure("Unexpected binary operation code: %d", l);
   }
-  push(box(result));
 }
 
-void interpreter::eval_const() {
-  push(box(next_int()));
+#ifdef TAGGED_ARITHMETIC
+/* Operators on boxed operands x = 2a + 1 and y = 2b + 1: x + y - 1 is the box
+   of a + b and boxing keeps the order of integers, so only multiplication and
+   division unbox anything. Division by zero traps in idiv as before.
+   Unsigned arithmetic wraps around like the boxing of the unboxed result. */
+HANDLER int32_t boxed_binop(char l, int32_t x, int32_t y) {
+  uint32_t ux = x, uy = y;
+  switch (l) {
+    case 1:
+      return ux + uy - 1;
+    case 2:
+      return ux - uy + 1;
+    case 3:
+      return (ux - 1) * unbox(y) + 1;
+    case 4:
+      return box(unbox(x) / unbox(y));
+    case 5:
+      return box(unbox(x) % unbox(y));
+    case 6:
+      return box(x < y);
+    case 7:
+      return box(x <= y);
+    case 8:
+      return box(x > y);
+    case 9:
+      return box(x >= y);
+    case 10:
+      return box(x == y);
+    case 11:
+      return box(x != y);
+    case 12:
+      return box(x != box(0) && y != box(0));
+    case 13:
+      return box((x | y) != box(0));
+    default:
+      failure("Unexpected binary operation code: %d", l);
+  }
 }
 
-void interpreter::eval_end() {
-  ip = epilogue();
+HANDLER bool compare(char l, int32_t x, int32_t y) {
+  switch (l) {
+    case 6:
+      return x < y;
+    case 7:
+      return x <= y;
+    case 8:
+      return x > y;
+    case 9:
+      return x >= y;
+    case 10:
+      return x == y;
+    case 11:
+      return x != y;
+    default:
+      return binop(l, unbox(x), unbox(y));
+  }
+}
+#else
+HANDLER int32_t boxed_binop(char l, int32_t x, int32_t y) {
+  return box(binop(l, unbox(x), unbox(y)));
 }
 
-void interpreter::eval_drop() {
-  pop();
+HANDLER bool compare(char l, int32_t x, int32_t y) {
+  return binop(l, unbox(x), unbox(y));
 }
+#endif // TAGGED_ARITHMETIC
 
-void interpreter::eval_st(char l) {
-  int32_t ind = next_int();
-  int32_t value = pop();
-  *get_by_location(l, ind) = value;
-  push(value);
+HANDLER void interpreter::eval_binop(registers &r, char l) {
+  int32_t y = r.pop();
+  int32_t x = r.pop();
+  r.push(boxed_binop(l, x, y));
 }
 
-void interpreter::eval_ld(char l) {
-  int32_t ind = next_int();
-  int32_t value = *get_by_location(l, ind);
-  push(value);
+HANDLER void interpreter::eval_const(registers &r, instruction *i) {
+  r.push(i->a);
 }
 
-void interpreter::eval_begin() {
-  int nargs = next_int();
-  int nlocals = next_int();
-  prologue(nlocals, nargs);
+HANDLER void interpreter::eval_end(registers &r) {
+  r.ip = epilogue(r);
 }
 
-void interpreter::eval_cbegin() {
-  eval_begin();
+HANDLER void interpreter::eval_drop(registers &r) {
+  r.pop();
 }
 
-void interpreter::eval_read() {
-  push(Lread());
+HANDLER void interpreter::eval_st(registers &r, char l, instruction *i) {
+  int32_t value = r.pop();
+  *get_by_location(r, l, i->a) = value;
+  r.push(value);
 }
 
-void interpreter::eval_write() {
-  push(Lwrite(pop()));
+HANDLER void interpreter::eval_ld(registers &r, char l, instruction *i) {
+  int32_t value = *get_by_location(r, l, i->a);
+  r.push(value);
 }
 
-void interpreter::eval_line() {
-  next_int();
+HANDLER void interpreter::eval_begin(registers &r, instruction *i) {
+  prologue(r, i);
 }
 
-void interpreter::eval_jmp() {
-  ip = bf->code_ptr + next_int();
+HANDLER void interpreter::eval_cbegin(registers &r, instruction *i) {
+  eval_begin(r, i);
 }
 
-void interpreter::eval_cjmp_nz() {
-  int32_t shift = next_int();
-  if (unbox(pop()) != 0) {
-    ip = bf->code_ptr + shift;
+HANDLER void interpreter::eval_read(registers &r) {
+#ifdef SNAPSHOT
+  if (snapshot_pending) {
+    take_snapshot(r);
   }
+#endif
+  save(r);
+  int32_t value = Lread();
+  restore(r);
+  r.push(value);
 }
 
-void interpreter::eval_cjmp_z() {
-  int32_t shift = next_int();
-  if (unbox(pop()) == 0) {
-    ip = bf->code_ptr + shift;
+HANDLER void interpreter::eval_write(registers &r) {
+#ifdef SNAPSHOT
+  if (snapshot_pending) {
+    take_snapshot(r);
   }
+#endif
+  int32_t value = r.pop();
+  save(r);
+  value = Lwrite(value);
+  restore(r);
+  r.push(value);
 }
 
-void interpreter::eval_call() {
-  int32_t shift = next_int();
-  int32_t nargs = next_int();
-  reverse(nargs);
-  push(reinterpret_cast<int32_t>(ip));
-  push(nargs);
-  ip = bf->code_ptr + shift;
+HANDLER void interpreter::eval_jmp(registers &r, instruction *i) {
+  r.ip = i->target;
 }
 
-void interpreter::eval_callc() {
-  int32_t nargs = next_int();
-  char* callee = reinterpret_cast<char*>(Belem(reinterpret_cast<int32_t*>(nth(nargs)), box(0)));
-  reverse(nargs);
-  push(reinterpret_cast<int32_t>(ip));
-  push(nargs + 1);
-  ip = callee;
+HANDLER void interpreter::eval_cjmp_nz(registers &r, instruction *i) {
+  if (unbox(r.pop()) != 0) {
+    r.ip = i->target;
+  }
+}
+
+HANDLER void interpreter::eval_cjmp_z(registers &r, instruction *i) {
+  if (unbox(r.pop()) == 0) {
+    r.ip = i->target;
+  }
+}
+
+HANDLER void interpreter::eval_call(registers &r, instruction *i) {
+  int32_t nargs = i->a;
+  r.push(reinterpret_cast<int32_t>(r.ip));
+  r.push(nargs);
+  r.ip = i->target;
+}
+
+/* Entry point of the closure under the `nargs` arguments of CALLC. Anything
+   but a closure is left to Belem, which reports it. */
+HANDLER instruction* interpreter::closure_entry(registers &r, int32_t nargs) {
+  int32_t value = r.nth(nargs);
+  int32_t *closure = reinterpret_cast<int32_t*>(value);
+  if (!is_boxed(value) && (closure[-1] & 7) == CLOSURE_TAG) {
+    return reinterpret_cast<instruction*>(closure[0]);
+  }
+  return reinterpret_cast<instruction*>(Belem(closure, box(0)));
+}
+
+HANDLER void interpreter::call_closure(registers &r, instruction *callee, int32_t nargs) {
+  r.push(reinterpret_cast<int32_t>(r.ip));
+  r.push(nargs + 1);
+  r.ip = callee;
+}
+
+HANDLER void interpreter::eval_callc(registers &r, instruction *i) {
+  int32_t nargs = i->a;
+  instruction *callee = closure_entry(r, nargs);
+#ifdef QUICKENING
+  i->op     = CALLC_MONO;
+  i->target = callee;
+#endif
+  call_closure(r, callee, nargs);
+}
+
+/* Monomorphic inline cache: the site has only called closures of i->target
+   so far, and a hit goes there without loading the entry point. The first
+   miss turns the site polymorphic. */
+HANDLER void interpreter::eval_callc_mono(registers &r, instruction *i) {
+  int32_t nargs = i->a;
+  int32_t value = r.nth(nargs);
+  int32_t *closure = reinterpret_cast<int32_t*>(value);
+  if (!is_boxed(value) && (closure[-1] & 7) == CLOSURE_TAG
+      && reinterpret_cast<instruction*>(closure[0]) == i->target) {
+    call_closure(r, i->target, nargs);
+    return;
+  }
+  i->op = CALLC_POLY;
+  eval_callc_poly(r, i);
+}
+
+/* The callee takes over the frame of the current function: its arguments
+   replace the current ones, and it returns straight to the current caller.
+   `nargs` counts the closure of CALLC. */
+HANDLER void interpreter::tail_call(registers &r, instruction *callee, int32_t nargs) {
+  int32_t *fp   = r.fp;
+  int32_t *args = r.flush();
+  int32_t *base = fp + 3 + fp[1];
+  int32_t  ra   = fp[2];
+  r.fp = reinterpret_cast<int32_t*>(fp[0]);
+  for (int32_t k = nargs - 1; k >= 0; k--) {
+    base[k - nargs] = args[k];
+  }
+  r.unwind(base - nargs);
+  r.push(ra);
+  r.push(nargs);
+  r.ip = callee;
+}
+
+HANDLER void interpreter::eval_tail_call(registers &r, instruction *i) {
+  tail_call(r, i->target, i->a);
 }
 
-void interpreter::eval_string() {
-  push(reinterpret_cast<int32_t>(Bstring(bf->string_ptr + next_int())));
+HANDLER void interpreter::eval_tail_callc(registers &r, instruction *i) {
+  int32_t nargs = i->a;
+  tail_call(r, closure_entry(r, nargs), nargs + 1);
 }
 
-void interpreter::eval_length() {
-  push(Llength(reinterpret_cast<void*>(pop())));
+/* A polymorphic site loads the entry point of every closure it calls */
+HANDLER void interpreter::eval_callc_poly(registers &r, instruction *i) {
+  int32_t nargs = i->a;
+  call_closure(r, closure_entry(r, nargs), nargs);
 }
 
-void interpreter::eval_sta() {
-  void *v = reinterpret_cast<void*>(pop());
-  int32_t i = pop();
+HANDLER void interpreter::eval_string(registers &r, instruction *i) {
+#ifdef INLINE_ALLOC
+  int32_t len = strlen(i->str);
+  int32_t *obj = allocate((len + sizeof(int32_t)) / sizeof(int32_t) + 1);
+  if (obj != nullptr) {
+    obj[0] = STRING_TAG | (len << 3);
+    memcpy(obj + 1, i->str, len + 1);
+    r.push(reinterpret_cast<int32_t>(obj + 1));
+    return;
+  }
+#endif
+  save(r);
+  int32_t res = reinterpret_cast<int32_t>(Bstring(i->str));
+  restore(r);
+  r.push(res);
+}
+
+HANDLER void interpreter::eval_length(registers &r) {
+  r.push(Llength(reinterpret_cast<void*>(r.pop())));
+}
+
+HANDLER void interpreter::eval_sta(registers &r) {
+  void *v = reinterpret_cast<void*>(r.pop());
+  int32_t i = r.pop();
   if (is_boxed(i)) {   
-    void *x = reinterpret_cast<void*>(pop());
-    push(reinterpret_cast<int32_t>(Bsta(v, i, x))); 
+    void *x = reinterpret_cast<void*>(r.pop());
+    r.push(reinterpret_cast<int32_t>(Bsta(v, i, x))); 
   } else {
-    push(reinterpret_cast<int32_t>(Bsta(v, i, nullptr)));
+    r.push(reinterpret_cast<int32_t>(Bsta(v, i, nullptr)));
+  }
+}
+
+HANDLER void interpreter::eval_elem(registers &r) {
+  int32_t v = r.pop();
+  void *p = reinterpret_cast<void*>(r.pop());
+  r.push(reinterpret_cast<int32_t>(Belem(p, v)));
+}
+
+/* Objects are laid out as in runtime.c: the header and the fields, the first
+   pushed field first; S-expressions have their tag in front of the header.
+   Objects without fields are the shared ones of the runtime */
+HANDLER void interpreter::eval_barray(registers &r, instruction *i) {
+  int32_t len = i->a;
+  if (len == 0) {
+    r.push(reinterpret_cast<int32_t>(Barray_empty()));
+    return;
   }
+#ifdef INLINE_ALLOC
+  int32_t *obj = allocate(len + 1);
+  if (obj != nullptr) {
+    int32_t *fields = r.flush();
+    obj[0] = ARRAY_TAG | (len << 3);
+    for (int32_t k = 0; k < len; k++) {
+      obj[len - k] = fields[k];
+    }
+    r.drop(len);
+    r.push(reinterpret_cast<int32_t>(obj + 1));
+    return;
+  }
+#endif
+  int32_t res = reinterpret_cast<int32_t>(Barray_my(box(len), save(r)));
+  restore(r);
+  r.drop(len);
+  r.push(res);
 }
 
-void interpreter::eval_elem() {
-  int32_t v = pop();
-  void *p = reinterpret_cast<void*>(pop());
-  push(reinterpret_cast<int32_t>(Belem(p, v)));
+HANDLER void interpreter::eval_sexp(registers &r, instruction *i) {
+  int32_t tag = LtagHash(i->str);
+#ifdef QUICKENING
+  i->op = QUICK_SEXP;
+  i->b  = tag;
+#endif
+  make_sexp(r, i->a, tag);
 }
 
-void interpreter::eval_barray() {
-  int32_t len = next_int();
-  reverse(len);
-  int32_t res = reinterpret_cast<int32_t>(Barray_my(box(len), get_stack_bottom()));
-  drop(len);
-  push(res);
+HANDLER void interpreter::eval_quick_sexp(registers &r, instruction *i) {
+  make_sexp(r, i->a, i->b);
+}
+
+HANDLER void interpreter::make_sexp(registers &r, int32_t len, int32_t tag) {
+  if (len == 0) {
+    void *singleton = Bsexp_nullary(tag);
+    if (singleton != nullptr) {
+      r.push(reinterpret_cast<int32_t>(singleton));
+      return;
+    }
+  }
+#ifdef INLINE_ALLOC
+  int32_t *obj = allocate(len + 2);
+  if (obj != nullptr) {
+    obj[0] = unbox(tag);
+    int32_t *fields = r.flush();
+    obj[1] = SEXP_TAG | (len << 3);
+    for (int32_t k = 0; k < len; k++) {
+      obj[len + 1 - k] = fields[k];
+    }
+    r.drop(len);
+    r.push(reinterpret_cast<int32_t>(obj + 2));
+    return;
+  }
+#endif
+  int32_t res = reinterpret_cast<int32_t>(Bsexp_my(box(len+1), tag, save(r)));
+  restore(r);
+  r.drop(len);
+  r.push(res);
 }
 
-void interpreter::eval_sexp() {
-  char *name = next_str();
-  int32_t len = next_int();
-  int32_t tag = LtagHash(name);
-  reverse(len);
-  int32_t res = reinterpret_cast<int32_t>(Bsexp_my(box(len+1), tag, get_stack_bottom()));
-  drop(len);
-  push(res);
+HANDLER void interpreter::eval_dup(registers &r) {
+  r.fill(2, r.pop());
 }
 
-void interpreter::eval_dup() {
-  fill(2, pop());
+HANDLER void interpreter::eval_tag(registers &r, instruction *i) {
+  int32_t n  = i->a;
+  int32_t t  = LtagHash(i->str);
+#ifdef QUICKENING
+  i->op = QUICK_TAG;
+  i->b  = t;
+#endif
+  void *d    = reinterpret_cast<void*>(r.pop());
+  r.push(Btag(d, t, box(n)));
 }
 
-void interpreter::eval_tag() {
-  char *name = next_str();
-  int32_t n  = next_int();
-  int32_t t  = LtagHash(name);
-  void *d    = reinterpret_cast<void*>(pop());
-  push(Btag(d, t, box(n)));
+HANDLER void interpreter::eval_quick_tag(registers &r, instruction *i) {
+  void *d = reinterpret_cast<void*>(r.pop());
+  r.push(Btag(d, i->b, box(i->a)));
 }
 
-void interpreter::eval_lstring() {
-  push(reinterpret_cast<int32_t>(Lstring(reinterpret_cast<void*>(pop()))));
+HANDLER void interpreter::eval_lstring(registers &r) {
+  void *p = reinterpret_cast<void*>(r.pop());
+  save(r);
+  int32_t res = reinterpret_cast<int32_t>(Lstring(p));
+  restore(r);
+  r.push(res);
 }
 
-void interpreter::eval_lda(char l) {
-  push(reinterpret_cast<int32_t>(get_by_location(l, next_int())));
+HANDLER void interpreter::eval_lda(registers &r, char l, instruction *i) {
+  r.push(reinterpret_cast<int32_t>(get_by_location(r, l, i->a)));
 }
 
-void interpreter::eval_array() {
-  int len = next_int();
-  int32_t res = Barray_patt(reinterpret_cast<int32_t*>(pop()), box(len));
-  push(res);
+HANDLER void interpreter::eval_array(registers &r, instruction *i) {
+  int len = i->a;
+  int32_t res = Barray_patt(reinterpret_cast<int32_t*>(r.pop()), box(len));
+  r.push(res);
 }
 
-void interpreter::eval_fail() {
-  int32_t a = next_int();
-  int32_t b = next_int();
-  failure("Explicitly failed with FAIL %d %d", a, b);
+HANDLER void interpreter::eval_fail(registers &r, instruction *i) {
+  save(r);
+  failure("Explicitly failed with FAIL %d %d", i->a, i->b);
 }
 
-void interpreter::eval_closure() {
-  int32_t shift = next_int();
-  int32_t n_binded = next_int();
+HANDLER void interpreter::eval_closure(registers &r, instruction *i) {
+  int32_t n_binded = i->a;
   int32_t binds[n_binded];
-  for (int i = 0; i < n_binded; i++) {
-    char l = next_char();
-    int value = next_int();
-    binds[i] = *get_by_location(l, value);
+  for (int k = 0; k < n_binded; k++) {
+    binds[k] = *get_by_location(r, i->binds[k].kind, i->binds[k].index);
+  }
+#ifdef INLINE_ALLOC
+  int32_t *obj = allocate(n_binded + 2);
+  if (obj != nullptr) {
+    obj[0] = CLOSURE_TAG | ((n_binded + 1) << 3);
+    obj[1] = reinterpret_cast<int32_t>(i->target);
+    memcpy(obj + 2, binds, n_binded * sizeof(int32_t));
+    r.push(reinterpret_cast<int32_t>(obj + 1));
+    return;
   }
-  push(reinterpret_cast<int32_t>(Bclosure_my(box(n_binded), bf->code_ptr + shift, binds)));
+#endif
+  save(r);
+  int32_t res = reinterpret_cast<int32_t>(Bclosure_my(box(n_binded), i->target, binds));
+  restore(r);
+  r.push(res);
 }
 
-void interpreter::eval_patt(char l) {
-  int32_t* elem = reinterpret_cast<int32_t*>(pop());
+HANDLER void interpreter::eval_patt(registers &r, char l) {
+  int32_t* elem = reinterpret_cast<int32_t*>(r.pop());
   int32_t res;
   switch (l) {
     case 0:
-      res = Bstring_patt(elem, reinterpret_cast<int32_t*>(pop()));
+      res = Bstring_patt(elem, reinterpret_cast<int32_t*>(r.pop()));
       break;
     case 1:
       res = Bstring_tag_patt(elem);
@@ -414,77 +783,525 @@ void interpreter::eval_patt(char l) {
     default:
       failure("Unexpected PATT");
   }
-  return push(res);
+  return r.push(res);
+}
+
+HANDLER void interpreter::eval_ld_ld_binop(registers &r, char l, instruction *i) {
+  r.push(boxed_binop(l, r.fp[i->a], r.fp[i->b]));
+}
+
+HANDLER void interpreter::eval_const_binop(registers &r, char l, instruction *i) {
+  int32_t x = r.pop();
+  r.push(boxed_binop(l, x, box(i->a)));
+}
+
+HANDLER void interpreter::eval_ld_const_binop(registers &r, char l, instruction *i) {
+  r.push(boxed_binop(l, r.fp[i->a], box(i->b)));
+}
+
+HANDLER void interpreter::eval_dup_tag(registers &r, instruction *i) {
+  int32_t t = LtagHash(i->str);
+#ifdef QUICKENING
+  i->op = QUICK_DUP_TAG;
+  i->b  = t;
+#endif
+  void *d = reinterpret_cast<void*>(r.nth(0));
+  r.push(Btag(d, t, box(i->a)));
+}
+
+HANDLER void interpreter::eval_quick_dup_tag(registers &r, instruction *i) {
+  void *d = reinterpret_cast<void*>(r.nth(0));
+  r.push(Btag(d, i->b, box(i->a)));
+}
+
+HANDLER void interpreter::eval_drop_jmp(registers &r, instruction *i) {
+  r.pop();
+  r.ip = i->target;
+}
+
+HANDLER void interpreter::eval_st_drop(registers &r, char l, instruction *i) {
+  *get_by_location(r, l, i->a) = r.pop();
+}
+
+/* Compare-and-branch handlers never box the result of the comparison */
+HANDLER void interpreter::eval_cmp_cjmp_z(registers &r, char l, instruction *i) {
+  int32_t y = r.pop();
+  int32_t x = r.pop();
+  if (!compare(l, x, y)) {
+    r.ip = i->target;
+  }
+}
+
+HANDLER void interpreter::eval_cmp_cjmp_nz(registers &r, char l, instruction *i) {
+  int32_t y = r.pop();
+  int32_t x = r.pop();
+  if (compare(l, x, y)) {
+    r.ip = i->target;
+  }
+}
+
+HANDLER void interpreter::eval_ld_ld_cmp_cjmp_z(registers &r, char l, instruction *i) {
+  if (!compare(l, r.fp[i->a], r.fp[i->b])) {
+    r.ip = i->target;
+  }
+}
+
+HANDLER void interpreter::eval_ld_ld_cmp_cjmp_nz(registers &r, char l, instruction *i) {
+  if (compare(l, r.fp[i->a], r.fp[i->b])) {
+    r.ip = i->target;
+  }
+}
+
+HANDLER void interpreter::eval_ld_const_cmp_cjmp_z(registers &r, char l, instruction *i) {
+  if (!compare(l, r.fp[i->a], box(i->b))) {
+    r.ip = i->target;
+  }
+}
+
+HANDLER void interpreter::eval_ld_const_cmp_cjmp_nz(registers &r, char l, instruction *i) {
+  if (compare(l, r.fp[i->a], box(i->b))) {
+    r.ip = i->target;
+  }
+}
+
+/* Register instructions address frame slots directly; locals are never held
+   in tos */
+HANDLER void interpreter::eval_reg_move(registers &r, instruction *i) {
+  r.fp[i->a] = r.fp[i->b];
+}
+
+HANDLER void interpreter::eval_reg_const(registers &r, instruction *i) {
+  r.fp[i->a] = i->b;
+}
+
+HANDLER void interpreter::eval_reg_binop(registers &r, char l, instruction *i) {
+  r.fp[i->a] = boxed_binop(l, r.fp[i->b], r.fp[i->c]);
+}
+
+HANDLER void interpreter::eval_reg_binop_const(registers &r, char l, instruction *i) {
+  r.fp[i->a] = boxed_binop(l, r.fp[i->b], box(i->c));
 }
 
+/* The scrutinee stays on the stack for the chosen alternative */
+HANDLER void interpreter::eval_case(registers &r, instruction *i) {
+  int32_t tag = 0;
+  int32_t len = Bcase_shape(reinterpret_cast<void*>(r.nth(0)), &tag);
+  r.ip = i->target;
+  if (len < 0) {
+    return;
+  }
+  for (uint32_t slot = case_slot(tag, len); ; slot++) {
+    const case_entry &e = i->cases[slot & i->a];
+    if (e.len < 0) {
+      return;
+    }
+    if (e.tag == tag && e.len == len) {
+      r.ip = e.target;
+      return;
+    }
+  }
+}
+
+/* Fields of tuples kept on the stack (see scalar_replacement.cpp); the tuple
+   is gone once SLIDE or DROP_N removes its fields */
+HANDLER void interpreter::eval_pick(registers &r, instruction *i) {
+  r.push(r.nth(i->a));
+}
+
+HANDLER void interpreter::eval_slide(registers &r, instruction *i) {
+  int32_t value = r.pop();
+  r.drop(i->a);
+  r.push(value);
+#ifdef STATS
+  avoided_allocations++;
+#endif
+}
+
+HANDLER void interpreter::eval_drop_n(registers &r, instruction *i) {
+  r.drop(i->a);
+#ifdef STATS
+  avoided_allocations++;
+#endif
+}
+
+/* Returns the n fields on top of the stack instead of one value if the frame
+   was entered through CALL_UNPACK; main has no return address */
+HANDLER bool interpreter::return_fields(registers &r, int32_t n) {
+  int32_t *fp = r.fp;
+  instruction *ra = reinterpret_cast<instruction*>(fp[2]);
+  if (ra == nullptr || ra[-1].op != CALL_UNPACK) {
+    return false;
+  }
+  int32_t *fields = r.flush();
+  int32_t *base   = fp + 3 + fp[1];
+  memmove(base - n, fields, n * sizeof(int32_t));
+  r.fp = reinterpret_cast<int32_t*>(fp[0]);
+  r.unwind(base - n);
+  r.ip = ra;
+  return true;
+}
+
+/* Otherwise the tuple is built and the following END returns it */
+HANDLER void interpreter::eval_barray_end(registers &r, instruction *i) {
+  if (!return_fields(r, i->a)) {
+    eval_barray(r, i);
+  }
+}
+
+HANDLER void interpreter::eval_sexp_end(registers &r, instruction *i) {
+  if (!return_fields(r, i->a)) {
+    make_sexp(r, i->a, LtagHash(i->str));
+  }
+}
+
+/* Compiled code works on the stack in memory and returns the instruction to
+   continue from */
+HANDLER void interpreter::eval_native(registers &r, instruction *i) {
+  native_frame frame;
+  frame.sp      = r.flush();
+  frame.fp      = r.fp;
+  frame.globals = r.globals;
+  r.ip = reinterpret_cast<native_code>(i->native)(&frame);
+  r.unwind(frame.sp);
+}
+
+#ifdef THREADED_DISPATCH
+
+/* Direct-threaded dispatch: every opcode of the decoded instructions, up to
+   OPCODES_NUMBER and including the extended ones above a byte, owns a label,
+   and every handler ends with its own copy of the dispatch jump, so the
+   indirect branch of each handler is predicted separately. */
+# define DISPATCH() i = r.ip++; goto *labels[i->op]
+
+void interpreter::run() {
+  registers r = enter();
+#ifdef SNAPSHOT
+  resume(r);
+#endif
+  void *labels[OPCODES_NUMBER];
+  instruction *i;
+
+  for (int k = 0; k < OPCODES_NUMBER; k++) {
+    labels[k] = &&op_invalid;
+  }
+
+# define FOR_BINOPS(M) \
+  M(1) M(2) M(3) M(4) M(5) M(6) M(7) M(8) M(9) M(10) M(11) M(12) M(13)
+# define FOR_COMPARISONS(M) \
+  M(6) M(7) M(8) M(9) M(10) M(11)
+
+# define BINOP_LABEL(l)          labels[BINOP | l]          = &&op_binop_##l;
+# define LD_LD_BINOP_LABEL(l)    labels[LD_LD_BINOP | l]    = &&op_ld_ld_binop_##l;
+# define CONST_BINOP_LABEL(l)    labels[CONST_BINOP | l]    = &&op_const_binop_##l;
+# define LD_CONST_BINOP_LABEL(l) labels[LD_CONST_BINOP | l] = &&op_ld_const_binop_##l;
+# define REG_BINOP_LABEL(l)       labels[REG_BINOP | l]       = &&op_reg_binop_##l;
+# define REG_BINOP_CONST_LABEL(l) labels[REG_BINOP_CONST | l] = &&op_reg_binop_const_##l;
+# define CMP_CJMP_LABELS(l)                                                     \
+  labels[CMP_CJMPZ | l]           = &&op_cmp_cjmp_z_##l;                        \
+  labels[CMP_CJMPNZ | l]          = &&op_cmp_cjmp_nz_##l;                       \
+  labels[LD_LD_CMP_CJMPZ | l]     = &&op_ld_ld_cmp_cjmp_z_##l;                  \
+  labels[LD_LD_CMP_CJMPNZ | l]    = &&op_ld_ld_cmp_cjmp_nz_##l;                 \
+  labels[LD_CONST_CMP_CJMPZ | l]  = &&op_ld_const_cmp_cjmp_z_##l;               \
+  labels[LD_CONST_CMP_CJMPNZ | l] = &&op_ld_const_cmp_cjmp_nz_##l;
+# define LOC_LABELS(h, name)              \
+  labels[(h << 4) | 0] = &&op_##name##_0; \
+  labels[(h << 4) | 1] = &&op_##name##_1; \
+  labels[(h << 4) | 2] = &&op_##name##_2; \
+  labels[(h << 4) | 3] = &&op_##name##_3;
+# define PATT_LABEL(l) labels[0x60 | l] = &&op_patt_##l;
+
+  FOR_BINOPS(BINOP_LABEL)
+
+  labels[0x10] = &&op_const;
+  labels[0x11] = &&op_string;
+  labels[0x12] = &&op_sexp;
+  labels[0x13] = &&op_sti;
+  labels[0x14] = &&op_sta;
+  labels[0x15] = &&op_jmp;
+  labels[0x16] = &&op_end;
+  labels[0x17] = &&op_ret;
+  labels[0x18] = &&op_drop;
+  labels[0x19] = &&op_dup;
+  labels[0x1a] = &&op_swap;
+  labels[0x1b] = &&op_elem;
+
+  LOC_LABELS(2, ld)
+  LOC_LABELS(3, lda)
+  LOC_LABELS(4, st)
+
+  labels[0x50] = &&op_cjmp_z;
+  labels[0x51] = &&op_cjmp_nz;
+  labels[0x52] = &&op_begin;
+  labels[0x53] = &&op_cbegin;
+  labels[0x54] = &&op_closure;
+  labels[0x55] = &&op_callc;
+  labels[0x56] = &&op_call;
+  labels[0x57] = &&op_tag;
+  labels[0x58] = &&op_array;
+  labels[0x59] = &&op_fail;
+
+  PATT_LABEL(0) PATT_LABEL(1) PATT_LABEL(2) PATT_LABEL(3)
+  PATT_LABEL(4) PATT_LABEL(5) PATT_LABEL(6)
+
+  labels[0x70] = &&op_read;
+  labels[0x71] = &&op_write;
+  labels[0x72] = &&op_length;
+  labels[0x73] = &&op_lstring;
+  labels[0x74] = &&op_barray;
+
+  labels[0xF0] = &&op_stop;
+
+  FOR_BINOPS(LD_LD_BINOP_LABEL)
+  FOR_BINOPS(CONST_BINOP_LABEL)
+  FOR_BINOPS(LD_CONST_BINOP_LABEL)
+  labels[DUP_TAG]  = &&op_dup_tag;
+  labels[DROP_JMP] = &&op_drop_jmp;
+  LOC_LABELS(0xC, st_drop)
+  labels[QUICK_SEXP]    = &&op_quick_sexp;
+  labels[QUICK_TAG]     = &&op_quick_tag;
+  labels[QUICK_DUP_TAG] = &&op_quick_dup_tag;
+  labels[CALLC_MONO]    = &&op_callc_mono;
+  labels[CALLC_POLY]    = &&op_callc_poly;
+  labels[TAIL_CALL]     = &&op_tail_call;
+  labels[TAIL_CALLC]    = &&op_tail_callc;
+  labels[NATIVE]        = &&op_native;
+  labels[REG_MOVE]      = &&op_reg_move;
+  labels[REG_CONST]     = &&op_reg_const;
+  labels[CASE]          = &&op_case;
+  labels[PICK]          = &&op_pick;
+  labels[SLIDE]         = &&op_slide;
+  labels[DROP_N]        = &&op_drop_n;
+  labels[CALL_UNPACK]   = &&op_call;
+  labels[BARRAY_END]    = &&op_barray_end;
+  labels[SEXP_END]      = &&op_sexp_end;
+  FOR_BINOPS(REG_BINOP_LABEL)
+  FOR_BINOPS(REG_BINOP_CONST_LABEL)
+  FOR_COMPARISONS(CMP_CJMP_LABELS)
+
+# undef BINOP_LABEL
+# undef LD_LD_BINOP_LABEL
+# undef CONST_BINOP_LABEL
+# undef LD_CONST_BINOP_LABEL
+# undef REG_BINOP_LABEL
+# undef REG_BINOP_CONST_LABEL
+# undef CMP_CJMP_LABELS
+# undef LOC_LABELS
+# undef PATT_LABEL
+
+  DISPATCH();
+
+# define BINOP_HANDLER(l)          op_binop_##l:          eval_binop(r, l);             DISPATCH();
+# define LD_LD_BINOP_HANDLER(l)    op_ld_ld_binop_##l:    eval_ld_ld_binop(r, l, i);    DISPATCH();
+# define CONST_BINOP_HANDLER(l)    op_const_binop_##l:    eval_const_binop(r, l, i);    DISPATCH();
+# define LD_CONST_BINOP_HANDLER(l) op_ld_const_binop_##l: eval_ld_const_binop(r, l, i); DISPATCH();
+# define REG_BINOP_HANDLER(l)       op_reg_binop_##l:       eval_reg_binop(r, l, i);       DISPATCH();
+# define REG_BINOP_CONST_HANDLER(l) op_reg_binop_const_##l: eval_reg_binop_const(r, l, i); DISPATCH();
+# define CMP_CJMP_HANDLERS(l)                                                          \
+  op_cmp_cjmp_z_##l:           eval_cmp_cjmp_z(r, l, i);           DISPATCH();        \
+  op_cmp_cjmp_nz_##l:          eval_cmp_cjmp_nz(r, l, i);          DISPATCH();        \
+  op_ld_ld_cmp_cjmp_z_##l:     eval_ld_ld_cmp_cjmp_z(r, l, i);     DISPATCH();        \
+  op_ld_ld_cmp_cjmp_nz_##l:    eval_ld_ld_cmp_cjmp_nz(r, l, i);    DISPATCH();        \
+  op_ld_const_cmp_cjmp_z_##l:  eval_ld_const_cmp_cjmp_z(r, l, i);  DISPATCH();        \
+  op_ld_const_cmp_cjmp_nz_##l: eval_ld_const_cmp_cjmp_nz(r, l, i); DISPATCH();
+# define LOC_HANDLERS(name)                                \
+  op_##name##_0: eval_##name(r, LOC_GLOBAL, i);  DISPATCH(); \
+  op_##name##_1: eval_##name(r, LOC_LOCAL, i);   DISPATCH(); \
+  op_##name##_2: eval_##name(r, LOC_ARG, i);     DISPATCH(); \
+  op_##name##_3: eval_##name(r, LOC_CLOSURE, i); DISPATCH();
+# define PATT_HANDLER(l) op_patt_##l: eval_patt(r, l); DISPATCH();
+
+  FOR_BINOPS(BINOP_HANDLER)
+
+op_const:   eval_const(r, i);   DISPATCH();
+op_string:  eval_string(r, i);  DISPATCH();
+op_sexp:    eval_sexp(r, i);    DISPATCH();
+op_sta:     eval_sta(r);        DISPATCH();
+op_jmp:     eval_jmp(r, i);     DISPATCH();
+op_drop:    eval_drop(r);       DISPATCH();
+op_dup:     eval_dup(r);        DISPATCH();
+op_elem:    eval_elem(r);       DISPATCH();
+
+op_end:
+  eval_end(r);
+  if (r.ip == nullptr) {
+    save(r);
+    return;
+  }
+  DISPATCH();
+
+  LOC_HANDLERS(ld)
+  LOC_HANDLERS(lda)
+  LOC_HANDLERS(st)
+
+op_cjmp_z:  eval_cjmp_z(r, i);  DISPATCH();
+op_cjmp_nz: eval_cjmp_nz(r, i); DISPATCH();
+op_begin:   eval_begin(r, i);   DISPATCH();
+op_cbegin:  eval_cbegin(r, i);  DISPATCH();
+op_closure: eval_closure(r, i); DISPATCH();
+op_callc:   eval_callc(r, i);   DISPATCH();
+op_call:    eval_call(r, i);    DISPATCH();
+op_tag:     eval_tag(r, i);     DISPATCH();
+op_array:   eval_array(r, i);   DISPATCH();
+op_fail:    eval_fail(r, i);    DISPATCH();
+
+  PATT_HANDLER(0) PATT_HANDLER(1) PATT_HANDLER(2) PATT_HANDLER(3)
+  PATT_HANDLER(4) PATT_HANDLER(5) PATT_HANDLER(6)
+
+op_read:    eval_read(r);       DISPATCH();
+op_write:   eval_write(r);      DISPATCH();
+op_length:  eval_length(r);     DISPATCH();
+op_lstring: eval_lstring(r);    DISPATCH();
+op_barray:  eval_barray(r, i);  DISPATCH();
+
+  FOR_BINOPS(LD_LD_BINOP_HANDLER)
+  FOR_BINOPS(CONST_BINOP_HANDLER)
+  FOR_BINOPS(LD_CONST_BINOP_HANDLER)
+
+op_dup_tag:  eval_dup_tag(r, i);  DISPATCH();
+op_drop_jmp: eval_drop_jmp(r, i); DISPATCH();
+
+op_quick_sexp:    eval_quick_sexp(r, i);    DISPATCH();
+op_quick_tag:     eval_quick_tag(r, i);     DISPATCH();
+op_quick_dup_tag: eval_quick_dup_tag(r, i); DISPATCH();
+op_callc_mono:    eval_callc_mono(r, i);    DISPATCH();
+op_callc_poly:    eval_callc_poly(r, i);    DISPATCH();
+op_tail_call:     eval_tail_call(r, i);     DISPATCH();
+op_tail_callc:    eval_tail_callc(r, i);    DISPATCH();
+op_native:        eval_native(r, i);        DISPATCH();
+op_reg_move:      eval_reg_move(r, i);      DISPATCH();
+op_reg_const:     eval_reg_const(r, i);     DISPATCH();
+op_case:          eval_case(r, i);          DISPATCH();
+op_pick:          eval_pick(r, i);          DISPATCH();
+op_slide:         eval_slide(r, i);         DISPATCH();
+op_drop_n:        eval_drop_n(r, i);        DISPATCH();
+op_barray_end:    eval_barray_end(r, i);    DISPATCH();
+op_sexp_end:      eval_sexp_end(r, i);      DISPATCH();
+
+  FOR_BINOPS(REG_BINOP_HANDLER)
+  FOR_BINOPS(REG_BINOP_CONST_HANDLER)
+
+  LOC_HANDLERS(st_drop)
+  FOR_COMPARISONS(CMP_CJMP_HANDLERS)
+
+# undef FOR_BINOPS
+# undef FOR_COMPARISONS
+# undef CMP_CJMP_HANDLERS
+# undef BINOP_HANDLER
+# undef LD_LD_BINOP_HANDLER
+# undef CONST_BINOP_HANDLER
+# undef LD_CONST_BINOP_HANDLER
+# undef REG_BINOP_HANDLER
+# undef REG_BINOP_CONST_HANDLER
+# undef LOC_HANDLERS
+# undef PATT_HANDLER
+
+op_sti:
+  save(r);
+  failure("STI instruction is deprecated");
+op_ret:
+  save(r);
+  failure("behaviour of RET is undefined");
+op_swap:
+  save(r);
+  failure("behaviour of SWAP is undefined");
+op_invalid:
+  save(r);
+  failure ("ERROR: invalid opcode %d-%d\n", (i->op & 0xF0) >> 4, i->op & 0x0F);
+op_stop:
+  save(r);
+  return;
+}
+
+# undef DISPATCH
+
+#else
+
+/* Gives every location kind its own copy of a LD/LDA/ST handler */
+# define LOC_CASES(name)                                      \
+  switch (l) {                                                \
+  case LOC_GLOBAL:  eval_##name(r, LOC_GLOBAL, i);  break;    \
+  case LOC_LOCAL:   eval_##name(r, LOC_LOCAL, i);   break;    \
+  case LOC_ARG:     eval_##name(r, LOC_ARG, i);     break;    \
+  case LOC_CLOSURE: eval_##name(r, LOC_CLOSURE, i); break;    \
+  default:          fail();                                   \
+  }
+
 void interpreter::run() {
-  FILE *f = stderr;
+  registers r = enter();
+#ifdef SNAPSHOT
+  resume(r);
+#endif
 
   do {
-    char x = next_char(),
-         h = (x & 0xF0) >> 4,
-         l = x & 0x0F;
+    instruction *i = r.ip++;
+    int32_t h = i->op >> 4;
+    char    l = i->op & 0x0F;
 
-    auto fail = [h, l]() {
+    auto fail = [this, &r, h, l]() {
+      save(r);
       failure ("ERROR: invalid opcode %d-%d\n", h, l);
     };
     
     switch (h) {
     case 15:
+      save(r);
       return;
       
     case 0:
-      eval_binop(l);
+      eval_binop(r, l);
       break;
       
     case 1:
       switch (l) {
       case  0:
-        eval_const();
+        eval_const(r, i);
         break;
         
       case  1:
-        eval_string();
+        eval_string(r, i);
         break;
           
       case  2:
-        eval_sexp();
+        eval_sexp(r, i);
         break;
         
       case  3:
+        save(r);
         failure("STI instruction is deprecated");
         break;
         
       case  4:
-        eval_sta();
+        eval_sta(r);
         break;
         
       case  5:
-        eval_jmp();
+        eval_jmp(r, i);
         break;
         
       case  6:
-        eval_end();
+        eval_end(r);
         break;
         
       case  7:
+        save(r);
         failure("behaviour of RET is undefined");
         break;
         
       case  8:
-        eval_drop();
+        eval_drop(r);
         break;
         
       case  9:
-        eval_dup();
+        eval_dup(r);
         break;
         
       case 10:
+        save(r);
         failure("behaviour of SWAP is undefined");
         break;
 
       case 11:
-        eval_elem();
+        eval_elem(r);
         break;
         
       default:
@@ -493,90 +1310,88 @@ void interpreter::run() {
       break;
       
     case 2:
+      LOC_CASES(ld)
+      break;
+
     case 3:
+      LOC_CASES(lda)
+      break;
+
     case 4:
-      switch (h - 2) {
-        case 0: eval_ld(l); break;
-        case 1: eval_lda(l); break;
-        case 2: eval_st(l); break;
-      }
+      LOC_CASES(st)
       break;
       
     case 5:
       switch (l) {
       case  0:
-        eval_cjmp_z();
+        eval_cjmp_z(r, i);
         break;
         
       case  1:
-        eval_cjmp_nz();
+        eval_cjmp_nz(r, i);
         break;
         
       case  2:
-        eval_begin();
+        eval_begin(r, i);
         break;
         
       case  3:
-        eval_cbegin();
+        eval_cbegin(r, i);
         break;
         
       case  4:
-        eval_closure();
+        eval_closure(r, i);
         break;
           
       case  5:
-        eval_callc();
+        eval_callc(r, i);
         break;
         
       case  6:
-        eval_call();
+        eval_call(r, i);
         break;
         
       case  7:
-        eval_tag();
+        eval_tag(r, i);
         break;
         
       case  8:
-        eval_array();
+        eval_array(r, i);
         break;
         
       case  9:
-        eval_fail();
+        eval_fail(r, i);
         break;
         
-      case 10:
-        eval_line();
-        break;
-
       default:
         fail();
       }
       break;
       
     case 6:
-      eval_patt(l);
+      eval_patt(r, l);
       break;
 
     case 7: {
       switch (l) {
       case 0:
-        eval_read();
+        eval_read(r);
         break;
         
       case 1:
-        eval_write();
+        eval_write(r);
         break;
 
       case 2:
-        eval_length();
+        eval_length(r);
         break;
 
       case 3:
-        eval_lstring();
+        eval_lstring(r);
         break;
 
       case 4:
-        eval_barray();
+        eval_barray(r, i);
         break;
 
       default:
@@ -584,10 +1399,174 @@ void interpreter::run() {
       }
     }
     break;
+
+    case 8:
+      eval_ld_ld_binop(r, l, i);
+      break;
+
+    case 9:
+      eval_const_binop(r, l, i);
+      break;
+
+    case 10:
+      eval_ld_const_binop(r, l, i);
+      break;
+
+    case 11:
+      switch (l) {
+      case 0:
+        eval_dup_tag(r, i);
+        break;
+
+      case 1:
+        eval_drop_jmp(r, i);
+        break;
+
+      default:
+        fail();
+      }
+      break;
+
+    case 12:
+      LOC_CASES(st_drop)
+      break;
+
+    case 13:
+      eval_cmp_cjmp_z(r, l, i);
+      break;
+
+    case 14:
+      eval_cmp_cjmp_nz(r, l, i);
+      break;
+
+    case 16:
+      eval_ld_ld_cmp_cjmp_z(r, l, i);
+      break;
+
+    case 17:
+      eval_ld_ld_cmp_cjmp_nz(r, l, i);
+      break;
+
+    case 18:
+      eval_ld_const_cmp_cjmp_z(r, l, i);
+      break;
+
+    case 19:
+      eval_ld_const_cmp_cjmp_nz(r, l, i);
+      break;
+
+    case 20:
+      switch (l) {
+      case 0:
+        eval_quick_sexp(r, i);
+        break;
+
+      case 1:
+        eval_quick_tag(r, i);
+        break;
+
+      case 2:
+        eval_quick_dup_tag(r, i);
+        break;
+
+      case 3:
+        eval_callc_mono(r, i);
+        break;
+
+      case 4:
+        eval_callc_poly(r, i);
+        break;
+
+      default:
+        fail();
+      }
+      break;
+
+    case 21:
+      switch (l) {
+      case 0:
+        eval_tail_call(r, i);
+        break;
+
+      case 1:
+        eval_tail_callc(r, i);
+        break;
+
+      default:
+        fail();
+      }
+      break;
+
+    case 22:
+      eval_native(r, i);
+      break;
+
+    case 23:
+      switch (l) {
+      case 0:
+        eval_reg_move(r, i);
+        break;
+
+      case 1:
+        eval_reg_const(r, i);
+        break;
+
+      default:
+        fail();
+      }
+      break;
+
+    case 24:
+      eval_reg_binop(r, l, i);
+      break;
+
+    case 25:
+      eval_reg_binop_const(r, l, i);
+      break;
+
+    case 26:
+      eval_case(r, i);
+      break;
+
+    case 27:
+      switch (l) {
+      case 0:
+        eval_pick(r, i);
+        break;
+
+      case 1:
+        eval_slide(r, i);
+        break;
+
+      case 2:
+        eval_drop_n(r, i);
+        break;
+
+      case 3:
+        eval_call(r, i);
+        break;
+
+      case 4:
+        eval_barray_end(r, i);
+        break;
+
+      case 5:
+        eval_sexp_end(r, i);
+        break;
+
+      default:
+        fail();
+      }
+      break;
       
     default:
       fail();
     }
   }
-  while (ip != nullptr);
-}
\ No newline at end of file
+  while (r.ip != nullptr);
+  save(r);
+}
+
+# undef LOC_CASES
+
+#endif // THREADED_DISPATCH
\ No newline at end of file
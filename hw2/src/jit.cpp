@@ -0,0 +1,562 @@
+#include <string.h>
+#include <sys/mman.h>
+#include "jit.h"
+
+extern "C" {
+  extern int Llength(void*);
+  extern void* Belem (void *p, int i);
+  extern void* Bsta (void *v, int i, void *x);
+  extern int LtagHash (char *s);
+  extern int Btag (void *d, int t, int n);
+  extern int Barray_patt (void *d, int n);
+  extern int Bstring_patt (void *x, void *y);
+  extern int Bstring_tag_patt (void *x);
+  extern int Barray_tag_patt (void *x);
+  extern int Bsexp_tag_patt (void *x);
+  extern int Bunboxed_patt (void *x);
+  extern int Bboxed_patt (void *x);
+  extern int Bclosure_tag_patt (void *x);
+}
+
+#ifndef __i386__
+# error "jit.cpp emits 32-bit x86 code"
+#endif
+
+/* Compiled code keeps the interpreter state in callee-saved registers:
+
+     esi  operand stack pointer (the top value is in memory at [esi])
+     edi  fp
+     ebx  globals
+     ebp  native_frame
+
+   Every run of instructions gets its own entry stubs, one per instruction that
+   is entered from the interpreter, and a shared exit that stores esi back to
+   the frame and returns the next instruction in eax. Runtime functions are
+   called with their arguments in the 12 bytes reserved at the bottom of the
+   machine stack, which keeps it 16-byte aligned at calls. */
+
+enum reg {
+  EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESP = 4, EBP = 5, ESI = 6, EDI = 7
+};
+
+const int32_t WORD = sizeof(int32_t);
+
+/* Condition codes of Jcc and SETcc */
+enum condition {
+  CC_E  = 0x4,
+  CC_NE = 0x5,
+  CC_L  = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G  = 0xF
+};
+
+class assembler {
+public:
+  std::vector<uint8_t> code;
+
+  size_t size() {
+    return code.size();
+  }
+
+  void byte(int32_t value) {
+    code.push_back(value);
+  }
+
+  void imm32(int32_t value) {
+    uint8_t bytes[WORD];
+    memcpy(bytes, &value, WORD);
+    code.insert(code.end(), bytes, bytes + WORD);
+  }
+
+  void patch32(size_t pos, int32_t value) {
+    memcpy(&code[pos], &value, WORD);
+  }
+
+  /* ModRM (and SIB for esp) of [base + disp] */
+  void mem(int32_t r, reg base, int32_t disp) {
+    bool short_disp = disp >= -128 && disp < 128;
+    byte((short_disp ? 0x40 : 0x80) | (r << 3) | base);
+    if (base == ESP) {
+      byte(0x24);
+    }
+    if (short_disp) {
+      byte(disp);
+    } else {
+      imm32(disp);
+    }
+  }
+
+  void load(reg dst, reg base, int32_t disp)  { byte(0x8B); mem(dst, base, disp); }
+  void store(reg base, int32_t disp, reg src) { byte(0x89); mem(src, base, disp); }
+  void lea(reg dst, reg base, int32_t disp)   { byte(0x8D); mem(dst, base, disp); }
+
+  void store_imm(reg base, int32_t disp, int32_t value) {
+    byte(0xC7);
+    mem(0, base, disp);
+    imm32(value);
+  }
+
+  void mov_imm(reg dst, int32_t value) {
+    byte(0xB8 + dst);
+    imm32(value);
+  }
+
+  /* add/sub r32, imm8 */
+  void add_imm(reg dst, int8_t value) { byte(0x83); byte(0xC0 | dst); byte(value); }
+  void sub_imm(reg dst, int8_t value) { byte(0x83); byte(0xE8 | dst); byte(value); }
+
+  /* Two-register instructions with the "op r/m32, r32" encoding */
+  void alu(int32_t opcode, reg dst, reg src) {
+    byte(opcode);
+    byte(0xC0 | (src << 3) | dst);
+  }
+
+  void push(reg r) { byte(0x50 + r); }
+  void pop(reg r)  { byte(0x58 + r); }
+  void ret()       { byte(0xC3); }
+
+  void call(void *function) {
+    mov_imm(EAX, reinterpret_cast<int32_t>(function));
+    byte(0xFF);
+    byte(0xD0);
+  }
+
+  /* Jumps return the position of their rel32 for patch_jump */
+  size_t jmp() {
+    byte(0xE9);
+    imm32(0);
+    return size() - WORD;
+  }
+
+  size_t jcc(condition cc) {
+    byte(0x0F);
+    byte(0x80 | cc);
+    imm32(0);
+    return size() - WORD;
+  }
+
+  void patch_jump(size_t pos, size_t target) {
+    patch32(pos, target - (pos + WORD));
+  }
+};
+
+/* Instructions that compile_run knows how to translate */
+static bool is_supported(const instruction &i) {
+  switch (i.op & ~0x0F) {
+  case BINOP:
+    return i.op >= BINOP + 1 && i.op <= BINOP + 13;
+  case LD:
+  case LDA:
+  case ST:
+    return (i.op & 0x0F) != LOC_CLOSURE;
+  case PATT:
+    return i.op <= PATT + 6;
+  }
+  switch (i.op) {
+  case CONST:
+  case JMP:
+  case CJMPZ:
+  case CJMPNZ:
+  case DROP:
+  case DUP:
+  case ELEM:
+  case STA:
+  case LENGTH:
+  case TAG:
+  case ARRAY:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static int32_t box(int32_t value) {
+  return (value << 1) | 1;
+}
+
+class run_compiler {
+private:
+  program *prog;
+  assembler &as;
+  int32_t begin;
+  int32_t end;
+
+  std::vector<size_t> labels;                          /* Offsets of instructions */
+  std::vector<std::pair<size_t, int32_t>> jumps;       /* Jumps inside the run    */
+  std::vector<std::pair<size_t, instruction*>> exits;  /* Jumps out of the run    */
+
+  bool inside(int32_t k) {
+    return k >= begin && k < end;
+  }
+
+  /* Address of a variable relative to a base register */
+  reg location_base(int32_t l) {
+    return l == LOC_GLOBAL ? EBX : EDI;
+  }
+
+  int32_t location_disp(int32_t l, int32_t index) {
+    switch (l) {
+    case LOC_GLOBAL: return index * WORD;
+    case LOC_LOCAL:  return -(index + 1) * WORD;
+    default:         return (index + 3) * WORD;
+    }
+  }
+
+  void push(reg r) {
+    as.sub_imm(ESI, WORD);
+    as.store(ESI, 0, r);
+  }
+
+  /* Jumps to the instruction with index k, leaving the run if needed */
+  void jump_to(size_t pos, int32_t k) {
+    if (inside(k)) {
+      jumps.push_back(std::make_pair(pos, k));
+    } else {
+      exits.push_back(std::make_pair(pos, &prog->code[k]));
+    }
+  }
+
+#ifdef TAGGED_ARITHMETIC
+  /* The operands stay boxed where the operator allows it, as in boxed_binop of
+     the interpreter; the rest go through compile_binop */
+  bool compile_boxed_binop(int32_t l) {
+    switch (l) {
+    case 1:
+      as.alu(0x01, EAX, ECX);
+      as.byte(0x48);                                 /* dec eax */
+      return true;
+    case 2:
+      as.alu(0x29, EAX, ECX);
+      as.byte(0x40);                                 /* inc eax */
+      return true;
+    case 3:
+      as.byte(0xD1); as.byte(0xF9);                  /* sar ecx, 1 */
+      as.byte(0x48);                                 /* dec eax */
+      as.byte(0x0F); as.byte(0xAF); as.byte(0xC1);   /* imul eax, ecx */
+      as.byte(0x40);                                 /* inc eax */
+      return true;
+    case 4:
+    case 5:
+      return false;
+    case 12:
+      /* eax = (eax != box(0)) & (ecx != box(0)) */
+      as.byte(0x83); as.byte(0xF8); as.byte(0x01);   /* cmp eax, 1 */
+      as.byte(0x0F); as.byte(0x95); as.byte(0xC0);   /* setne al */
+      as.byte(0x83); as.byte(0xF9); as.byte(0x01);   /* cmp ecx, 1 */
+      as.byte(0x0F); as.byte(0x95); as.byte(0xC1);   /* setne cl */
+      as.byte(0x20); as.byte(0xC8);                  /* and al, cl */
+      break;
+    case 13:
+      as.alu(0x09, EAX, ECX);
+      as.byte(0x83); as.byte(0xF8); as.byte(0x01);   /* cmp eax, 1 */
+      as.byte(0x0F); as.byte(0x95); as.byte(0xC0);   /* setne al */
+      break;
+    default: {
+      static const condition conditions[] = { CC_L, CC_LE, CC_G, CC_GE, CC_E, CC_NE };
+      as.alu(0x39, EAX, ECX);
+      as.byte(0x0F); as.byte(0x90 | conditions[l - 6]); as.byte(0xC0);
+    }
+    }
+    as.byte(0x0F); as.byte(0xB6); as.byte(0xC0);     /* movzx eax, al */
+    /* lea eax, [eax + eax + 1] */
+    as.byte(0x8D); as.byte(0x44); as.byte(0x00); as.byte(0x01);
+    return true;
+  }
+#endif
+
+  void compile_binop(int32_t l) {
+    as.load(ECX, ESI, 0);
+    as.load(EAX, ESI, WORD);
+    as.add_imm(ESI, WORD);
+#ifdef TAGGED_ARITHMETIC
+    if (compile_boxed_binop(l)) {
+      as.store(ESI, 0, EAX);
+      return;
+    }
+#endif
+    as.byte(0xD1); as.byte(0xF9);     /* sar ecx, 1 */
+    as.byte(0xD1); as.byte(0xF8);     /* sar eax, 1 */
+    switch (l) {
+    case 1: as.alu(0x01, EAX, ECX); break;
+    case 2: as.alu(0x29, EAX, ECX); break;
+    case 3: as.byte(0x0F); as.byte(0xAF); as.byte(0xC1); break;   /* imul eax, ecx */
+    case 4:
+    case 5:
+      /* Division by zero traps just like in the interpreter */
+      as.byte(0x99);                                             /* cdq      */
+      as.byte(0xF7); as.byte(0xF9);                              /* idiv ecx */
+      if (l == 5) {
+        as.alu(0x89, EAX, EDX);
+      }
+      break;
+    case 12:
+      /* eax = (eax != 0) & (ecx != 0) */
+      as.alu(0x85, EAX, EAX);
+      as.byte(0x0F); as.byte(0x95); as.byte(0xC0);   /* setne al */
+      as.alu(0x85, ECX, ECX);
+      as.byte(0x0F); as.byte(0x95); as.byte(0xC1);   /* setne cl */
+      as.byte(0x20); as.byte(0xC8);                  /* and al, cl */
+      as.byte(0x0F); as.byte(0xB6); as.byte(0xC0);   /* movzx eax, al */
+      break;
+    case 13:
+      as.alu(0x09, EAX, ECX);
+      as.alu(0x85, EAX, EAX);
+      as.byte(0x0F); as.byte(0x95); as.byte(0xC0);
+      as.byte(0x0F); as.byte(0xB6); as.byte(0xC0);
+      break;
+    default: {
+      static const condition conditions[] = { CC_L, CC_LE, CC_G, CC_GE, CC_E, CC_NE };
+      as.alu(0x39, EAX, ECX);
+      as.byte(0x0F); as.byte(0x90 | conditions[l - 6]); as.byte(0xC0);
+      as.byte(0x0F); as.byte(0xB6); as.byte(0xC0);
+    }
+    }
+    /* lea eax, [eax + eax + 1] */
+    as.byte(0x8D); as.byte(0x44); as.byte(0x00); as.byte(0x01);
+    as.store(ESI, 0, EAX);
+  }
+
+  /* Pops `nargs` operands as the arguments of a runtime function, the top one
+     last, and pushes its result */
+  void call_runtime(void *function, int32_t nargs) {
+    for (int32_t n = 0; n < nargs; n++) {
+      as.load(EAX, ESI, (nargs - 1 - n) * WORD);
+      as.store(ESP, n * WORD, EAX);
+    }
+    as.call(function);
+    if (nargs > 1) {
+      as.add_imm(ESI, (nargs - 1) * WORD);
+    }
+    as.store(ESI, 0, EAX);
+  }
+
+  void compile_sta() {
+    /* Bsta(v, i, x) for an index, Bsta(v, addr, 0) for an address from LDA */
+    as.load(EAX, ESI, 0);
+    as.store(ESP, 0, EAX);
+    as.load(EAX, ESI, WORD);
+    as.store(ESP, WORD, EAX);
+    as.byte(0xA8); as.byte(0x01);                    /* test al, 1 */
+    size_t to_address = as.jcc(CC_E);
+    as.load(EAX, ESI, 2 * WORD);
+    as.store(ESP, 2 * WORD, EAX);
+    as.add_imm(ESI, WORD);
+    size_t to_call = as.jmp();
+    as.patch_jump(to_address, as.size());
+    as.store_imm(ESP, 2 * WORD, 0);
+    as.patch_jump(to_call, as.size());
+    as.call(reinterpret_cast<void*>(Bsta));
+    as.add_imm(ESI, WORD);
+    as.store(ESI, 0, EAX);
+  }
+
+  void compile(const instruction &i) {
+    int32_t l = i.op & 0x0F;
+    switch (i.op & ~0x0F) {
+    case BINOP:
+      compile_binop(l);
+      return;
+
+    case LD:
+      as.load(EAX, location_base(l), location_disp(l, i.a));
+      push(EAX);
+      return;
+
+    case LDA:
+      as.lea(EAX, location_base(l), location_disp(l, i.a));
+      push(EAX);
+      return;
+
+    case ST:
+      as.load(EAX, ESI, 0);
+      as.store(location_base(l), location_disp(l, i.a), EAX);
+      return;
+
+    case PATT: {
+      static void * const patterns[] = {
+        reinterpret_cast<void*>(Bstring_patt),    reinterpret_cast<void*>(Bstring_tag_patt),
+        reinterpret_cast<void*>(Barray_tag_patt), reinterpret_cast<void*>(Bsexp_tag_patt),
+        reinterpret_cast<void*>(Bboxed_patt),     reinterpret_cast<void*>(Bunboxed_patt),
+        reinterpret_cast<void*>(Bclosure_tag_patt)
+      };
+      if (l == 0) {
+        /* Bstring_patt(top, next) */
+        as.load(EAX, ESI, 0);
+        as.store(ESP, 0, EAX);
+        as.load(EAX, ESI, WORD);
+        as.store(ESP, WORD, EAX);
+        as.call(patterns[0]);
+        as.add_imm(ESI, WORD);
+        as.store(ESI, 0, EAX);
+      } else {
+        call_runtime(patterns[l], 1);
+      }
+      return;
+    }
+    }
+
+    switch (i.op) {
+    case CONST:
+      as.sub_imm(ESI, WORD);
+      as.store_imm(ESI, 0, i.a);
+      break;
+
+    case DROP:
+      as.add_imm(ESI, WORD);
+      break;
+
+    case DUP:
+      as.load(EAX, ESI, 0);
+      push(EAX);
+      break;
+
+    case JMP:
+      jump_to(as.jmp(), i.target - prog->code.data());
+      break;
+
+    case CJMPZ:
+    case CJMPNZ:
+      as.load(EAX, ESI, 0);
+      as.add_imm(ESI, WORD);
+      as.byte(0xD1); as.byte(0xF8);     /* sar eax, 1 */
+      jump_to(as.jcc(i.op == CJMPZ ? CC_E : CC_NE), i.target - prog->code.data());
+      break;
+
+    case ELEM:
+      call_runtime(reinterpret_cast<void*>(Belem), 2);
+      break;
+
+    case LENGTH:
+      call_runtime(reinterpret_cast<void*>(Llength), 1);
+      break;
+
+    case STA:
+      compile_sta();
+      break;
+
+    case TAG:
+      as.store_imm(ESP, WORD, LtagHash(i.str));
+      as.store_imm(ESP, 2 * WORD, box(i.a));
+      call_runtime(reinterpret_cast<void*>(Btag), 1);
+      break;
+
+    case ARRAY:
+      as.store_imm(ESP, WORD, box(i.a));
+      call_runtime(reinterpret_cast<void*>(Barray_patt), 1);
+      break;
+    }
+  }
+
+public:
+  run_compiler(program *prog, assembler &as, int32_t begin, int32_t end):
+    prog(prog), as(as), begin(begin), end(end), labels(end - begin) {}
+
+  /* Returns the offsets of the entry stubs of `entries` */
+  std::vector<size_t> compile_run(const std::vector<int32_t> &entries) {
+    for (int32_t k = begin; k < end; k++) {
+      labels[k - begin] = as.size();
+      compile(prog->code[k]);
+    }
+    exits.push_back(std::make_pair(as.jmp(), &prog->code[end]));
+
+    /* Exits: store sp, return the next instruction */
+    size_t leave = as.size();
+    as.store(EBP, 0, ESI);
+    as.add_imm(ESP, 3 * WORD);
+    as.pop(EDI);
+    as.pop(ESI);
+    as.pop(EBX);
+    as.pop(EBP);
+    as.ret();
+    for (auto &exit : exits) {
+      as.patch_jump(exit.first, as.size());
+      as.mov_imm(EAX, reinterpret_cast<int32_t>(exit.second));
+      as.patch_jump(as.jmp(), leave);
+    }
+    for (auto &jump : jumps) {
+      as.patch_jump(jump.first, labels[jump.second - begin]);
+    }
+
+    std::vector<size_t> result;
+    for (int32_t k : entries) {
+      result.push_back(as.size());
+      as.push(EBP);
+      as.push(EBX);
+      as.push(ESI);
+      as.push(EDI);
+      as.sub_imm(ESP, 3 * WORD);
+      as.load(EBP, ESP, 8 * WORD);   /* 3 reserved, 4 saved, return address */
+      as.load(ESI, EBP, 0);
+      as.load(EDI, EBP, WORD);
+      as.load(EBX, EBP, 2 * WORD);
+      as.patch_jump(as.jmp(), labels[k - begin]);
+    }
+    return result;
+  }
+};
+
+void compile_native(program *prog) {
+  std::vector<instruction> &code = prog->code;
+  std::vector<bool> targets(code.size(), false);
+  for (const instruction &i : code) {
+    if (has_target(i.op)) {
+      targets[i.target - code.data()] = true;
+    }
+  }
+  for (const case_entry &e : prog->cases) {
+    if (e.len >= 0) {
+      targets[e.target - code.data()] = true;
+    }
+  }
+
+  /* Runs of one instruction are cheaper to interpret than to enter */
+  assembler as;
+  std::vector<std::pair<int32_t, size_t>> entries;
+  int32_t size = code.size();
+  for (int32_t begin = 0; begin < size; ) {
+    int32_t end = begin;
+    while (end < size && is_supported(code[end])) {
+      end++;
+    }
+    if (end - begin < 2) {
+      begin = end + 1;
+      continue;
+    }
+
+    /* The interpreter enters a run at its start and at branch targets; return
+       addresses of calls are always run starts */
+    std::vector<int32_t> run_entries;
+    for (int32_t k = begin; k < end; k++) {
+      if (k == begin || targets[k]) {
+        run_entries.push_back(k);
+      }
+    }
+    run_compiler compiler(prog, as, begin, end);
+    std::vector<size_t> offsets = compiler.compile_run(run_entries);
+    for (size_t n = 0; n < offsets.size(); n++) {
+      entries.push_back(std::make_pair(run_entries[n], offsets[n]));
+    }
+    begin = end + 1;
+  }
+
+  if (entries.empty()) {
+    return;
+  }
+
+  /* Written once, then only executed; the mapping lives as long as the program */
+  void *buffer = mmap(nullptr, as.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    failure("ERROR: cannot allocate memory for compiled code\n");
+  }
+  memcpy(buffer, as.code.data(), as.size());
+  if (mprotect(buffer, as.size(), PROT_READ | PROT_EXEC) != 0) {
+    failure("ERROR: cannot make compiled code executable\n");
+  }
+
+  for (auto &entry : entries) {
+    instruction &i = code[entry.first];
+    i.op     = NATIVE;
+    i.native = static_cast<uint8_t*>(buffer) + entry.second;
+  }
+}
@@ -0,0 +1,147 @@
+#include "layout.h"
+
+/* Layout heuristics without a profile. A function is hot if it has a loop (a
+   backward jump), calls itself or is called from a loop of another function.
+   A path is cold if it is only entered by jumps and runs straight into FAIL:
+   these are the failed matches of case expressions. Instructions that fall
+   through to the next one keep it as their successor, so the reordering only
+   moves code that is entered by jumps, and calls keep their return address. */
+
+/* Execution never continues with the next instruction */
+static bool is_terminator(int32_t op) {
+  switch (op) {
+  case JMP:
+  case DROP_JMP:
+  case END:
+  case FAIL:
+  case STOP:
+  case TAIL_CALL:
+  case TAIL_CALLC:
+  case CASE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_call(int32_t op) {
+  return op == CALL || op == CALL_UNPACK || op == TAIL_CALL;
+}
+
+static bool is_jump(int32_t op) {
+  return has_target(op) && !is_call(op) && op != CLOSURE;
+}
+
+static bool is_function(int32_t op) {
+  return op == BEGIN || op == CBEGIN;
+}
+
+void layout_code(program *prog) {
+  std::vector<instruction> &code = prog->code;
+  int32_t size = code.size();
+
+  std::vector<bool> cold(size, false);
+  int32_t cold_paths = 0;
+  for (int32_t k = 1; k < size; k++) {
+    if (!is_terminator(code[k - 1].op)) {
+      continue;
+    }
+    int32_t end = k;
+    bool entry = false;
+    while (end < size && !is_terminator(code[end].op)) {
+      entry = entry || is_function(code[end].op);
+      end++;
+    }
+    if (end < size && code[end].op == FAIL && !entry) {
+      for (int32_t j = k; j <= end; j++) {
+        cold[j] = true;
+      }
+      cold_paths++;
+    }
+    k = end;
+  }
+
+  /* Functions: index 0 and every BEGIN start one */
+  std::vector<int32_t> function_of(size);
+  std::vector<int32_t> starts;
+  for (int32_t k = 0; k < size; k++) {
+    if (k == 0 || is_function(code[k].op)) {
+      starts.push_back(k);
+    }
+    function_of[k] = starts.size() - 1;
+  }
+  int32_t functions = starts.size();
+
+  std::vector<bool> hot(functions, false);
+  std::vector<bool> in_loop(size, false);
+  for (int32_t k = 0; k < size; k++) {
+    const instruction &i = code[k];
+    if (is_jump(i.op) && i.ref <= k) {
+      hot[function_of[k]] = true;
+      for (int32_t j = i.ref; j <= k; j++) {
+        in_loop[j] = true;
+      }
+    }
+  }
+  for (int32_t k = 0; k < size; k++) {
+    const instruction &i = code[k];
+    if (!is_call(i.op)) {
+      continue;
+    }
+    if (function_of[i.ref] == function_of[k]) {
+      hot[function_of[k]] = true;
+    } else if (in_loop[k]) {
+      hot[function_of[i.ref]] = true;
+    }
+  }
+
+  /* A function that falls through to the next one stays in front of it */
+  std::vector<std::vector<int32_t>> units;
+  std::vector<bool> unit_hot;
+  bool joined = false;
+  for (int32_t f = 0; f < functions; f++) {
+    int32_t end = f + 1 < functions ? starts[f + 1] : size;
+    if (!joined) {
+      units.push_back(std::vector<int32_t>());
+      unit_hot.push_back(false);
+    }
+    int32_t last = -1;
+    for (int32_t k = starts[f]; k < end; k++) {
+      if (!cold[k]) {
+        units.back().push_back(k);
+        last = k;
+      }
+    }
+    unit_hot.back() = unit_hot.back() || hot[f];
+    joined = last >= 0 && !is_terminator(code[last].op);
+  }
+
+  std::vector<int32_t> order;
+  order.reserve(size);
+  int32_t hot_functions = 0;
+  auto place = [&order, &units](size_t u) {
+    order.insert(order.end(), units[u].begin(), units[u].end());
+  };
+  place(0);
+  for (size_t u = 1; u < units.size(); u++) {
+    if (unit_hot[u]) {
+      place(u);
+      hot_functions++;
+    }
+  }
+  for (size_t u = 1; u < units.size(); u++) {
+    if (!unit_hot[u]) {
+      place(u);
+    }
+  }
+  for (int32_t k = 0; k < size; k++) {
+    if (cold[k]) {
+      order.push_back(k);
+    }
+  }
+
+  prog->reorder(order);
+#ifdef STATS
+  fprintf(stderr, "layout: %d hot functions, %d cold paths moved out of line\n", hot_functions, cold_paths);
+#endif
+}
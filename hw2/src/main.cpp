@@ -1,4 +1,16 @@
 #include "interpreter.h"
+#include "verifier.h"
+#include "inliner.h"
+#include "peephole.h"
+#include "scalar_replacement.h"
+#include "case_dispatch.h"
+#include "tailcall.h"
+#include "register_ir.h"
+#include "fusion.h"
+#include "layout.h"
+#include "jit.h"
+#include "cache.h"
+#include "stack.h"
 
 extern "C" {
   extern void __init (void);
@@ -9,10 +21,65 @@ extern int32_t *__gc_stack_top, *__gc_stack_bottom;
 void *__start_custom_data;
 void *__stop_custom_data;
 
+/* Load-time passes, from the decoded bytecode to the program ready to link */
+static void optimize(program *prog) {
+  std::vector<int32_t> depth = verify(prog);
+#ifdef INLINING
+  if (inline_functions(prog, depth, INLINE_SIZE) > 0) {
+    verify(prog);
+  }
+#endif
+#ifdef PEEPHOLE
+  optimize_peephole(prog);
+#endif
+#ifdef SCALAR_REPLACEMENT
+  replace_tuples(prog);
+#endif
+#ifdef CASE_DISPATCH
+  compile_case_chains(prog);
+#endif
+#ifdef TAIL_CALLS
+  mark_tail_calls(prog);
+#endif
+  /* The JIT compiles plain instructions only */
+#if defined(REGISTER_IR) && !defined(JIT)
+  translate_to_registers(prog);
+#endif
+#if defined(FUSION) && !defined(JIT)
+  fuse_superinstructions(prog);
+#endif
+#ifdef LAYOUT
+  layout_code(prog);
+#endif
+}
+
 int main (int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s file.bc\n", argv[0]);
+    return 1;
+  }
   __init();
   bytefile bf(argv[1]);
-  interpreter interpreter_instance(&bf, __gc_stack_top, __gc_stack_bottom);
+#ifdef CACHE
+  program prog(&bf, false);
+  if (!load_cache(&prog, argv[1])) {
+    prog.decode();
+    optimize(&prog);
+    store_cache(&prog, argv[1]);
+  }
+#else
+  program prog(&bf);
+  optimize(&prog);
+#endif
+  prog.link();
+#ifdef JIT
+  compile_native(&prog);
+#endif
+  interpreter interpreter_instance(&prog, __gc_stack_top, __gc_stack_bottom, argv[1]);
+#ifdef STACK_GUARD
+  run_guarded([](void *instance) { static_cast<interpreter*>(instance)->run(); }, &interpreter_instance);
+#else
   interpreter_instance.run();
+#endif
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include "peephole.h"
+
+/* Every rewrite replaces a window of instructions by a shorter one and marks
+   the rest with NOP; program::remove_nops() then fixes jump targets and lines.
+   Only the first instruction of a window may be a branch target, so a jump
+   into a window still sees the rewritten code from its start. The pass is
+   repeated while something changes: folding one BINOP may enable the next. */
+
+static int32_t box(int32_t value) {
+  return (value << 1) | 1;
+}
+
+static int32_t unbox(int32_t value) {
+  return value >> 1;
+}
+
+static bool is_binop(const instruction &i) {
+  return i.op >= BINOP + 1 && i.op <= BINOP + 13;
+}
+
+static bool is_variable(const instruction &i, int32_t kind) {
+  return (i.op & ~0x0F) == kind;
+}
+
+/* Same arithmetic as the interpreter, with wrapping instead of overflow;
+   returns false for division by zero, which has to trap at run time */
+static bool fold(int32_t op, int32_t lhv, int32_t rhv, int32_t &result) {
+  uint32_t l = lhv;
+  uint32_t r = rhv;
+  switch (op) {
+  case 1:  result = l + r; break;
+  case 2:  result = l - r; break;
+  case 3:  result = l * r; break;
+  case 4:
+  case 5:
+    if (rhv == 0) {
+      return false;
+    }
+    result = op == 4 ? lhv / rhv : lhv % rhv;
+    break;
+  case 6:  result = lhv <  rhv; break;
+  case 7:  result = lhv <= rhv; break;
+  case 8:  result = lhv >  rhv; break;
+  case 9:  result = lhv >= rhv; break;
+  case 10: result = lhv == rhv; break;
+  case 11: result = lhv != rhv; break;
+  case 12: result = lhv && rhv; break;
+  case 13: result = lhv || rhv; break;
+  default: return false;
+  }
+  return true;
+}
+
+class peephole {
+private:
+  std::vector<instruction> &code;
+  std::vector<bool> targets;
+  int32_t removed;
+
+  /* Instructions k + 1 .. k + length - 1 are not entered by jumps */
+  bool window(size_t k, size_t length) {
+    if (k + length > code.size()) {
+      return false;
+    }
+    for (size_t j = 1; j < length; j++) {
+      if (targets[k + j]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void remove(size_t k) {
+    code[k].op = NOP;
+    removed++;
+  }
+
+  /* Next instruction that is not removed */
+  size_t next(size_t k) {
+    do {
+      k++;
+    } while (k < code.size() && code[k].op == NOP);
+    return k;
+  }
+
+  /* Final target of a chain of JMPs, skipping removed instructions; a cycle
+     of JMPs is left alone */
+  int32_t thread(int32_t target) {
+    int32_t result = target;
+    for (size_t steps = 0; steps <= code.size(); steps++) {
+      while (code[result].op == NOP) {
+        result++;
+      }
+      if (code[result].op != JMP) {
+        return result;
+      }
+      result = code[result].ref;
+    }
+    return target;
+  }
+
+  bool rewrite(size_t k) {
+    instruction &i = code[k];
+    size_t k1 = next(k);
+    size_t k2 = k1 < code.size() ? next(k1) : k1;
+
+    /* Windows are contiguous once NOPs are skipped; a skipped NOP that is a
+       branch target would be entered in the middle */
+    auto contiguous = [this, k](size_t end) {
+      for (size_t j = k + 1; j <= end; j++) {
+        if (targets[j]) {
+          return false;
+        }
+      }
+      return end < code.size();
+    };
+
+    switch (i.op) {
+    case JMP:
+    case CJMPZ:
+    case CJMPNZ: {
+      int32_t target = thread(i.ref);
+      if (i.op == JMP && code[target].op == END) {
+        i.op  = END;
+        i.ref = 0;
+        return true;
+      }
+      if (target != i.ref) {
+        targets[target] = true;
+        i.ref = target;
+        return true;
+      }
+      /* Jumps to the removed JMP land on its target anyway */
+      if (i.op == JMP && next(k) == static_cast<size_t>(target)) {
+        remove(k);
+        return true;
+      }
+      return false;
+    }
+
+    case DUP:
+    case CONST:
+      if (contiguous(k1) && code[k1].op == DROP) {
+        remove(k);
+        remove(k1);
+        return true;
+      }
+      break;
+    }
+
+    if (is_variable(i, LD) && contiguous(k1) && code[k1].op == DROP) {
+      remove(k);
+      remove(k1);
+      return true;
+    }
+
+    /* CONST a; CONST b; BINOP */
+    if (i.op == CONST && contiguous(k2) && code[k1].op == CONST && is_binop(code[k2])) {
+      int32_t result;
+      if (fold(code[k2].op, unbox(i.a), unbox(code[k1].a), result)) {
+        i.a = box(result);
+        remove(k1);
+        remove(k2);
+        return true;
+      }
+    }
+
+    /* CONST k; CJMPz/CJMPnz */
+    if (i.op == CONST && contiguous(k1) && (code[k1].op == CJMPZ || code[k1].op == CJMPNZ)) {
+      bool taken = (unbox(i.a) == 0) == (code[k1].op == CJMPZ);
+      if (taken) {
+        i.op  = JMP;
+        i.a   = 0;
+        i.ref = code[k1].ref;
+        remove(k1);
+      } else {
+        remove(k);
+        remove(k1);
+      }
+      return true;
+    }
+
+    /* ST x; DROP; LD x */
+    if (is_variable(i, ST) && contiguous(k2) && code[k1].op == DROP &&
+        code[k2].op == (LD | (i.op & 0x0F)) && code[k2].a == i.a) {
+      remove(k1);
+      remove(k2);
+      return true;
+    }
+
+    return false;
+  }
+
+public:
+  peephole(program *prog): code(prog->code), targets(prog->branch_targets()), removed(0) {}
+
+  int32_t run() {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t k = 0; k < code.size(); k++) {
+        if (code[k].op != NOP && rewrite(k)) {
+          changed = true;
+        }
+      }
+    }
+    return removed;
+  }
+};
+
+int32_t optimize_peephole(program *prog) {
+  int32_t removed = peephole(prog).run();
+  prog->remove_nops();
+#ifdef STATS
+  fprintf(stderr, "peephole: %d instructions removed\n", removed);
+#endif
+  return removed;
+}
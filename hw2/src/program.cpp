@@ -0,0 +1,378 @@
+#include <string.h>
+#include "program.h"
+
+bool has_target(int32_t op) {
+  switch (op) {
+    case JMP:
+    case CJMPZ:
+    case CJMPNZ:
+    case CALL:
+    case CALL_UNPACK:
+    case TAIL_CALL:
+    case CLOSURE:
+    case DROP_JMP:
+    case CASE:
+      return true;
+  }
+  switch (op & ~0x0F) {
+    case CMP_CJMPZ:
+    case CMP_CJMPNZ:
+    case LD_LD_CMP_CJMPZ:
+    case LD_LD_CMP_CJMPNZ:
+    case LD_CONST_CMP_CJMPZ:
+    case LD_CONST_CMP_CJMPNZ:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool has_string(int32_t op) {
+  switch (op) {
+    case STRING:
+    case SEXP:
+    case SEXP_END:
+    case TAG:
+    case DUP_TAG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int32_t box(int32_t value) {
+  return (value << 1) | 1;
+}
+
+program::program(bytefile *bf, bool decode_code): linked(false), bf(bf) {
+  if (decode_code) {
+    decode();
+  }
+}
+
+void program::decode() {
+  const char *begin = bf->code_ptr;
+  const char *end   = bf->code_ptr + bf->code_size;
+  const char *ip    = begin;
+
+  /* index_of[offset] is the index of the instruction decoded from that offset;
+     LINE is dropped, so its offset maps to the next instruction */
+  std::vector<int32_t> index_of(bf->code_size + 1, -1);
+
+  /* Arguments stay on the stack in the order they were pushed, so argument
+     indices are counted from the last argument of the enclosing function */
+  int32_t nargs = 0;
+  auto arg_index = [&nargs](int32_t index) {
+    return nargs - 1 - index;
+  };
+
+  auto next_int = [&ip, end]() {
+    if (ip + sizeof(int32_t) > end) {
+      failure("ERROR: unexpected end of bytecode\n");
+    }
+    int32_t result;
+    memcpy(&result, ip, sizeof(int32_t));
+    ip += sizeof(int32_t);
+    return result;
+  };
+
+  auto next_char = [&ip, end]() {
+    if (ip >= end) {
+      failure("ERROR: unexpected end of bytecode\n");
+    }
+    return *ip++;
+  };
+
+  while (ip < end) {
+    index_of[ip - begin] = code.size();
+
+    char x = next_char(),
+         h = (x & 0xF0) >> 4,
+         l = x & 0x0F;
+
+    instruction i;
+    i.op  = static_cast<unsigned char>(x);
+    i.a   = 0;
+    i.b   = 0;
+    i.ref = 0;
+
+    auto fail = [h, l]() {
+      failure ("ERROR: invalid opcode %d-%d\n", h, l);
+    };
+
+    switch (h) {
+    case 15:
+      i.op = STOP;
+      break;
+
+    case 0:
+      if (l < 1 || l > 13) {
+        fail();
+      }
+      break;
+
+    case 1:
+      switch (l) {
+      case  0: i.a = box(next_int()); break;
+      case  1: i.ref = next_int(); break;
+      case  2: i.ref = next_int(); i.a = next_int(); break;
+      case  3: case  4: case  6: case  7: case  8:
+      case  9: case 10: case 11: break;
+      case  5: i.ref = next_int(); break;
+      default: fail();
+      }
+      break;
+
+    case 2:
+    case 3:
+    case 4:
+      if (l > LOC_CLOSURE) {
+        fail();
+      }
+      i.a = next_int();
+      if (l == LOC_ARG) {
+        i.a = arg_index(i.a);
+      }
+      break;
+
+    case 5:
+      switch (l) {
+      case  0:
+      case  1:
+        i.ref = next_int();
+        break;
+
+      case  2:
+      case  3:
+        i.a = next_int();
+        i.b = next_int();
+        nargs = i.a;
+        break;
+
+      case  4: {
+        i.ref = next_int();
+        i.a   = next_int();
+        i.b   = binds.size();
+        for (int k = 0; k < i.a; k++) {
+          location loc;
+          loc.kind  = next_char();
+          loc.index = next_int();
+          if (loc.kind < LOC_GLOBAL || loc.kind > LOC_CLOSURE) {
+            fail();
+          }
+          if (loc.kind == LOC_ARG) {
+            loc.index = arg_index(loc.index);
+          }
+          binds.push_back(loc);
+        }
+        break;
+      }
+
+      case  5:
+        i.a = next_int();
+        break;
+
+      case  6:
+        i.ref = next_int();
+        i.a   = next_int();
+        break;
+
+      case  7:
+        i.ref = next_int();
+        i.a   = next_int();
+        break;
+
+      case  8:
+        i.a = next_int();
+        break;
+
+      case  9:
+        i.a = next_int();
+        i.b = next_int();
+        break;
+
+      case 10: {
+        line_info info;
+        info.index = code.size();
+        info.line  = next_int();
+        lines.push_back(info);
+        continue;
+      }
+
+      default:
+        fail();
+      }
+      break;
+
+    case 6:
+      if (l > 6) {
+        fail();
+      }
+      break;
+
+    case 7:
+      switch (l) {
+      case 0: case 1: case 2: case 3: break;
+      case 4: i.a = next_int(); break;
+      default: fail();
+      }
+      break;
+
+    default:
+      fail();
+    }
+
+    code.push_back(i);
+  }
+  index_of[bf->code_size] = code.size();
+
+  /* Jumps past the last instruction land on an implicit STOP */
+  instruction stop;
+  stop.op  = STOP;
+  stop.a   = 0;
+  stop.b   = 0;
+  stop.ref = 0;
+  code.push_back(stop);
+
+  for (instruction &i : code) {
+    if (has_target(i.op)) {
+      if (i.ref < 0 || i.ref > bf->code_size || index_of[i.ref] < 0) {
+        failure("ERROR: invalid jump target 0x%.8x\n", i.ref);
+      }
+      i.ref = index_of[i.ref];
+    } else if (has_string(i.op)) {
+      if (i.ref < 0 || bf->string_ptr + i.ref >= bf->code_ptr) {
+        failure("ERROR: invalid string table offset %d\n", i.ref);
+      }
+    }
+  }
+}
+
+std::vector<bool> program::branch_targets() {
+  std::vector<bool> result(code.size(), false);
+  result[0] = true;
+  for (const instruction &i : code) {
+    if (has_target(i.op)) {
+      result[i.ref] = true;
+    }
+  }
+  for (const case_entry &e : cases) {
+    if (e.len >= 0) {
+      result[e.ref] = true;
+    }
+  }
+  return result;
+}
+
+void program::remove_nops() {
+  std::vector<int32_t> new_index(code.size() + 1);
+  int32_t n = 0;
+  for (size_t k = 0; k < code.size(); k++) {
+    new_index[k] = n;
+    if (code[k].op != NOP) {
+      code[n++] = code[k];
+    }
+  }
+  new_index[code.size()] = n;
+  code.resize(n);
+
+  for (instruction &i : code) {
+    if (has_target(i.op)) {
+      i.ref = new_index[i.ref];
+    }
+  }
+  for (case_entry &e : cases) {
+    if (e.len >= 0) {
+      e.ref = new_index[e.ref];
+    }
+  }
+  for (line_info &info : lines) {
+    info.index = new_index[info.index];
+  }
+}
+
+/* Puts instruction order[k] at index k; every instruction is kept, so a line
+   is recorded wherever the line of consecutive instructions changes */
+void program::reorder(const std::vector<int32_t> &order) {
+  std::vector<int32_t> line_of(code.size(), 0);
+  size_t next = 0;
+  int32_t line = 0;
+  for (size_t k = 0; k < code.size(); k++) {
+    while (next < lines.size() && lines[next].index <= static_cast<int32_t>(k)) {
+      line = lines[next++].line;
+    }
+    line_of[k] = line;
+  }
+
+  std::vector<int32_t> new_index(code.size() + 1);
+  std::vector<instruction> reordered;
+  reordered.reserve(code.size());
+  for (int32_t old : order) {
+    new_index[old] = reordered.size();
+    reordered.push_back(code[old]);
+  }
+  new_index[code.size()] = code.size();
+
+  lines.clear();
+  for (size_t k = 0; k < order.size(); k++) {
+    int32_t current = line_of[order[k]];
+    if (lines.empty() ? current != 0 : lines.back().line != current) {
+      line_info info;
+      info.index = k;
+      info.line  = current;
+      lines.push_back(info);
+    }
+  }
+
+  code.swap(reordered);
+  for (instruction &i : code) {
+    if (has_target(i.op)) {
+      i.ref = new_index[i.ref];
+    }
+  }
+  for (case_entry &e : cases) {
+    if (e.len >= 0) {
+      e.ref = new_index[e.ref];
+    }
+  }
+}
+
+void program::link() {
+  if (linked) {
+    return;
+  }
+  for (instruction &i : code) {
+    if (has_target(i.op)) {
+      i.target = &code[i.ref];
+    } else if (has_string(i.op)) {
+      i.str = bf->get_string(i.ref);
+    }
+    if (i.op == CLOSURE) {
+      i.binds = binds.data() + i.b;
+    } else if (i.op == CASE) {
+      i.cases = cases.data() + i.b;
+    }
+  }
+  for (case_entry &e : cases) {
+    if (e.len >= 0) {
+      e.target = &code[e.ref];
+    }
+  }
+  linked = true;
+}
+
+instruction* program::entry() {
+  return code.data();
+}
+
+int32_t program::get_line(const instruction *i) {
+  int32_t index = i - code.data();
+  int32_t line  = 0;
+  for (const line_info &info : lines) {
+    if (info.index > index) {
+      break;
+    }
+    line = info.line;
+  }
+  return line;
+}
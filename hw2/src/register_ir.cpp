@@ -0,0 +1,138 @@
+#include "register_ir.h"
+
+/* An assignment statement on the operand stack
+
+     leaf; (leaf; BINOP)*; ST x; DROP
+
+   has a net stack effect of zero, so it can run without touching the operand
+   stack at all. Every BINOP becomes one three-address instruction: the first
+   one computes into x, the next ones update x in place. Slots are addressed
+   by their offset from fp, like in the fused LD superinstructions.
+
+     LD a; LD b; BINOP op; ...     REG_BINOP op        x = a op b
+     LD a; CONST k; BINOP op; ...  REG_BINOP_CONST op  x = a op k
+     ...; LD c; BINOP op           REG_BINOP op        x = x op c
+     ...; CONST k; BINOP op        REG_BINOP_CONST op  x = x op k
+     LD a; ST x; DROP              REG_MOVE            x = a
+     CONST k; ST x; DROP           REG_CONST           x = k
+
+   The operand stack is the same before and after each register instruction
+   and none of them allocates, so the GC sees the same stack as before. */
+
+/* A local or an argument */
+static bool frame_slot(const instruction &i, int32_t kind, int32_t &offset) {
+  if (i.op == (kind | LOC_LOCAL)) {
+    offset = -i.a - 1;
+    return true;
+  }
+  if (i.op == (kind | LOC_ARG)) {
+    offset = i.a + 3;
+    return true;
+  }
+  return false;
+}
+
+static bool is_binop(const instruction &i) {
+  return i.op >= BINOP + 1 && i.op <= BINOP + 13;
+}
+
+static int32_t unbox(int32_t value) {
+  return value >> 1;
+}
+
+static instruction make(int32_t op, int32_t a, int32_t b, int32_t c) {
+  instruction result;
+  result.op = op;
+  result.a  = a;
+  result.b  = b;
+  result.c  = c;
+  return result;
+}
+
+/* Translates the statement starting at k into `out`; returns the number of
+   instructions it replaces, or 0 if there is no statement there */
+static int32_t translate(const std::vector<instruction> &code, const std::vector<bool> &targets,
+                         size_t k, std::vector<instruction> &out) {
+  auto inside = [&code, &targets, k](size_t n) {
+    return n < code.size() && (n == k || !targets[n]);
+  };
+
+  int32_t first = 0;
+  bool first_is_slot = frame_slot(code[k], LD, first);
+  if (!first_is_slot && code[k].op != CONST) {
+    return 0;
+  }
+
+  /* (leaf, BINOP) pairs */
+  size_t n = k + 1;
+  std::vector<std::pair<const instruction*, const instruction*>> steps;
+  while (inside(n) && inside(n + 1) && is_binop(code[n + 1])) {
+    int32_t offset;
+    if (!frame_slot(code[n], LD, offset) && code[n].op != CONST) {
+      break;
+    }
+    steps.push_back(std::make_pair(&code[n], &code[n + 1]));
+    n += 2;
+  }
+
+  int32_t x;
+  if (!inside(n) || !inside(n + 1) || !frame_slot(code[n], ST, x) || code[n + 1].op != DROP) {
+    return 0;
+  }
+
+  if (steps.empty()) {
+    out.push_back(first_is_slot ? make(REG_MOVE, x, first, 0) : make(REG_CONST, x, code[k].a, 0));
+    return n + 2 - k;
+  }
+
+  /* A constant on the left of the first operator stays on the stack */
+  if (!first_is_slot) {
+    return 0;
+  }
+
+  std::vector<instruction> result;
+  int32_t left = first;
+  for (auto &step : steps) {
+    const instruction &leaf = *step.first;
+    int32_t op = step.second->op & 0x0F;
+    int32_t right;
+    if (frame_slot(leaf, LD, right)) {
+      /* x is overwritten by the first step */
+      if (!result.empty() && right == x) {
+        return 0;
+      }
+      result.push_back(make(REG_BINOP | op, x, left, right));
+    } else {
+      result.push_back(make(REG_BINOP_CONST | op, x, left, unbox(leaf.a)));
+    }
+    left = x;
+  }
+  out.insert(out.end(), result.begin(), result.end());
+  return n + 2 - k;
+}
+
+void translate_to_registers(program *prog) {
+  std::vector<instruction> &code = prog->code;
+  std::vector<bool> targets = prog->branch_targets();
+
+  size_t k = 0;
+  while (k < code.size()) {
+    std::vector<instruction> out;
+    int32_t length = translate(code, targets, k, out);
+    if (length == 0) {
+      k++;
+      continue;
+    }
+    /* Register instructions are never longer than the statement */
+    for (size_t j = 0; j < static_cast<size_t>(length); j++) {
+      if (j < out.size()) {
+        code[k + j] = out[j];
+      } else {
+        code[k + j].op = NOP;
+      }
+    }
+    k += length;
+  }
+
+  prog->remove_nops();
+}
@@ -34,6 +34,11 @@ static pool to_space;
 size_t      *current;
 /* end */
 
+/* The free part of the from-space for the inline allocation in the
+   interpreter, which has to fall back to alloc() when an object does not fit */
+size_t **__gc_heap_current = &from_space.current;
+size_t **__gc_heap_end     = &from_space.end;
+
 # ifdef __ENABLE_GC__
 
 /* GC extern invariant for built-in functions */
@@ -51,10 +56,6 @@ void __post_gc_subst () {}
 # endif
 /* end */
 
-# define STRING_TAG  0x00000001
-# define ARRAY_TAG   0x00000003
-# define SEXP_TAG    0x00000005
-# define CLOSURE_TAG 0x00000007 
 # define UNBOXED_TAG 0x00000009 // Not actually a tag; used to return from LkindOf
 
 # define LEN(x) ((x & 0xFFFFFFF8) >> 3)
@@ -126,14 +127,14 @@ void pop_extra_root (void ** p) {
 
 /* end */
 
-static void vfailure (char *s, va_list args) {
+static void __attribute__ ((noreturn)) vfailure (const char *s, va_list args) {
   fflush   (stdout);
   fprintf  (stderr, "*** FAILURE: ");
   vfprintf (stderr, s, args); // vprintf (char *, va_list) <-> printf (char *, ...)
   exit     (255);
 }
 
-void failure (char *s, ...) {
+void failure (const char *s, ...) {
   va_list args;
 
   va_start (args, s);
@@ -450,14 +451,14 @@ static void printStringBuf (char *fmt, ...) {
   vprintStringBuf (fmt, args);
 }
 
-int is_valid_heap_pointer (void *p);
+int is_object (void *p);
 
 static void printValue (void *p) {
   data *a = (data*) BOX(NULL);
   int i   = BOX(0);
   if (UNBOXED(p)) printStringBuf ("%d", UNBOX(p));
   else {
-    if (! is_valid_heap_pointer(p)) {
+    if (! is_object(p)) {
       printStringBuf ("0x%x", p);
       return;
     }
@@ -742,7 +743,7 @@ int inner_hash (int depth, unsigned acc, void *p) {
   if (depth > HASH_DEPTH) return acc;
 
   if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
-  else if (is_valid_heap_pointer (p)) {
+  else if (is_object (p)) {
     data *a = TO_DATA(p);
     int t = TAG(a->tag), l = LEN(a->tag), i;
 
@@ -828,8 +829,8 @@ extern int Lcompare (void *p, void *q) {
   }
   else if (UNBOXED(q)) return BOX(1);
   else {
-    if (is_valid_heap_pointer (p)) {
-      if (is_valid_heap_pointer (q)) {
+    if (is_object (p)) {
+      if (is_object (q)) {
         data *a = TO_DATA(p), *b = TO_DATA(q);
         int ta = TAG(a->tag), tb = TAG(b->tag);
         int la = LEN(a->tag), lb = LEN(b->tag);
@@ -877,7 +878,7 @@ extern int Lcompare (void *p, void *q) {
       }
       else return BOX(-1);
     }
-    else if (is_valid_heap_pointer (q)) return BOX(1);
+    else if (is_object (q)) return BOX(1);
     else return BOX (p - q);
   }
 }
@@ -1113,12 +1114,71 @@ extern void* Bclosure_my (int bn, void *entry, int *values) {
   return r->contents;
 }
 
+/* Objects without fields never change, so the empty array and one nullary
+   S-expression per tag are built once outside the heap and shared. The GC
+   leaves them where they are; is_object makes them compare, hash and print
+   as heap objects do */
+# define MAX_SINGLETONS 1024
+
+static sexp singletons[MAX_SINGLETONS];
+static data empty_array = { ARRAY_TAG };
+
+# define IS_SINGLETON(p)					\
+  ((size_t)(p) == (size_t)empty_array.contents ||		\
+   ((size_t)singletons < (size_t)(p) &&				\
+    (size_t)(p) <= (size_t)(singletons + MAX_SINGLETONS)))
+
+int is_valid_heap_pointer (void *p);
+
+int is_object (void *p) {
+  return is_valid_heap_pointer (p) || (!UNBOXED(p) && IS_SINGLETON(p));
+}
+
+extern void* Barray_empty () {
+  return empty_array.contents;
+}
+
+/* The table of nullary S-expressions, for heap snapshots */
+extern void* __gc_singletons (size_t *bytes) {
+  *bytes = sizeof(singletons);
+  return singletons;
+}
+
+/* The nullary S-expression of a boxed tag, or NULL if the table is full */
+extern void* Bsexp_nullary (int tag) {
+  unsigned slot = (unsigned) UNBOX(tag);
+  int      k;
+
+  for (k = 0; k < MAX_SINGLETONS; k++, slot++) {
+    sexp *r = &singletons[slot % MAX_SINGLETONS];
+
+    if (r->contents.tag == 0) {
+      r->contents.tag = SEXP_TAG;
+#ifndef DEBUG_PRINT
+      r->tag = UNBOX(tag);
+#else
+      r->tag = SEXP_TAG | (UNBOX(tag) << 3);
+#endif
+      return r->contents.contents;
+    }
+#ifndef DEBUG_PRINT
+    if (r->tag == UNBOX(tag)) return r->contents.contents;
+#else
+    if (GET_SEXP_TAG(r->tag) == UNBOX(tag)) return r->contents.contents;
+#endif
+  }
+
+  return NULL;
+}
+
 extern void* Barray (int bn, ...) {
   va_list args; 
   int     i, ai; 
   data    *r; 
   int     n = UNBOX(bn);
     
+  if (n == 0) return Barray_empty ();
+
   __pre_gc ();
   
 #ifdef DEBUG_PRINT
@@ -1145,11 +1205,15 @@ extern void* Barray (int bn, ...) {
   return r->contents;
 }
 
+// data_ points to the last element: elements lie on the interpreter stack in
+// the order they were pushed
 extern void* Barray_my (int bn, int *data_) {
   int     i, ai; 
   data    *r; 
   int     n = UNBOX(bn);
     
+  if (n == 0) return Barray_empty ();
+
   __pre_gc ();
   
 #ifdef DEBUG_PRINT
@@ -1160,7 +1224,7 @@ extern void* Barray_my (int bn, int *data_) {
 
   r->tag = ARRAY_TAG | (n << 3);
   
-  for (i = 0; i<n; i++) {
+  for (i = n-1; i>=0; i--) {
     ai = *(data_++);
     ((int*)r->contents)[i] = ai;
   }
@@ -1181,6 +1245,15 @@ extern void* Bsexp (int bn, ...) {
   data   *d;  
   int n = UNBOX(bn); 
 
+  if (n == 1) {
+    void *s;
+
+    va_start(args, bn);
+    s = Bsexp_nullary (va_arg(args, int));
+    va_end(args);
+    if (s != NULL) return s;
+  }
+
   __pre_gc () ;
   
 #ifdef DEBUG_PRINT
@@ -1218,6 +1291,7 @@ extern void* Bsexp (int bn, ...) {
   return d->contents;
 }
 
+// data_ points to the last field, as in Barray_my
 extern void* Bsexp_my (int bn, int tag, int *data_) { 
   int     i;    
   int     ai;  
@@ -1226,6 +1300,11 @@ extern void* Bsexp_my (int bn, int tag, int *data_) {
   data   *d;  
   int n = UNBOX(bn); 
 
+  if (n == 1) {
+    void *s = Bsexp_nullary (tag);
+    if (s != NULL) return s;
+  }
+
   __pre_gc () ;
   
 #ifdef DEBUG_PRINT
@@ -1238,7 +1317,7 @@ extern void* Bsexp_my (int bn, int tag, int *data_) {
     
   d->tag = SEXP_TAG | ((n-1) << 3);
   
-  for (i=0; i<n-1; i++) {
+  for (i=n-2; i>=0; i--) {
     ai = *(data_++);
     
     p = (size_t*) ai;
@@ -1285,6 +1364,30 @@ extern int Barray_patt (void *d, int n) {
   }
 }
 
+/* Shape of the scrutinee of the case dispatch in the interpreter: returns the
+   number of elements of an S-expression or an array and stores its tag (-1 for
+   an array); returns -1 for other values */
+extern int Bcase_shape (void *d, int *tag) {
+  data *r;
+
+  if (UNBOXED(d)) return -1;
+  r = TO_DATA(d);
+  switch (TAG(r->tag)) {
+  case SEXP_TAG:
+#ifndef DEBUG_PRINT
+    *tag = TO_SEXP(d)->tag;
+#else
+    *tag = GET_SEXP_TAG(TO_SEXP(d)->tag);
+#endif
+    return LEN(r->tag);
+  case ARRAY_TAG:
+    *tag = -1;
+    return LEN(r->tag);
+  default:
+    return -1;
+  }
+}
+
 extern int Bstring_patt (void *x, void *y) {
   data *rx = (data *) BOX (NULL),
        *ry = (data *) BOX (NULL);
@@ -2031,6 +2134,34 @@ extern void __init (void) {
   init_extra_roots ();
 }
 
+/* Heap snapshots of the interpreter: the used part of the from-space is saved
+   as it is and later copied to the beginning of a fresh from-space, where the
+   interpreter relocates the pointers in it */
+extern void* __gc_heap_used (size_t *bytes) {
+  *bytes = (from_space.current - from_space.begin) * sizeof(size_t);
+  return from_space.begin;
+}
+
+/* Makes the empty from-space hold `bytes` of objects and returns its beginning */
+extern void* __gc_heap_load (size_t bytes) {
+  size_t words = (bytes + sizeof(size_t) - 1) / sizeof(size_t);
+
+  if (words >= from_space.size) {
+    while (words >= SPACE_SIZE) SPACE_SIZE = SPACE_SIZE << 1;
+    munmap (from_space.begin, from_space.size * sizeof(size_t));
+    from_space.begin = mmap (NULL, SPACE_SIZE * sizeof(size_t), PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (from_space.begin == MAP_FAILED) {
+      perror ("EROOR: __gc_heap_load: mmap failed\n");
+      exit   (1);
+    }
+    from_space.end  = from_space.begin + SPACE_SIZE;
+    from_space.size = SPACE_SIZE;
+  }
+  from_space.current = from_space.begin + words;
+  return from_space.begin;
+}
+
 static void* gc (size_t size) {
   if (! enable_GC) {
     Lfailure ("GC disabled");
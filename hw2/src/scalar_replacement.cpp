@@ -0,0 +1,306 @@
+#include <string.h>
+#include <algorithm>
+#include "scalar_replacement.h"
+
+/* A tuple built by BARRAY n or SEXP t n keeps its fields on the stack where
+   it is only destructured right away:
+
+     BARRAY n                     ->  (removed)
+     DUP; ARRAY n; CJMPz F        ->  (removed, always true)
+     DUP; CONST i; ELEM           ->  PICK n-1-i
+     CONST i; ELEM                ->  PICK n-1-i; SLIDE n
+     DROP                         ->  DROP_N n
+
+   Between these, values pushed above the tuple may be used freely as long as
+   the tuple itself is not touched. A conditional jump taken with the tuple on
+   top goes through a stub that builds the tuple after all, so the code at F
+   is unchanged. Any other use of the tuple, a branch target inside the
+   sequence or a jump with values above the tuple cancels the rewrite.
+
+   The tuple may also come from a call: if every END of a function directly
+   follows the same BARRAY n or SEXP t n, a call site that destructures the
+   result becomes CALL_UNPACK, and the constructors of the callee become
+   BARRAY_END or SEXP_END. These return the fields themselves when the frame
+   was entered through CALL_UNPACK and build the tuple for any other caller. */
+
+static const int32_t MAX_FIELDS = 8;
+static const int32_t MAX_SEQUENCE = 64;
+
+static int32_t unbox(int32_t value) {
+  return value >> 1;
+}
+
+static bool is_binop(const instruction &i) {
+  return i.op >= BINOP + 1 && i.op <= BINOP + 13;
+}
+
+class scalar_replacement {
+private:
+  program *prog;
+  std::vector<instruction> &code;
+  std::vector<bool> targets;
+  /* Index of the BEGIN of the function of every instruction */
+  std::vector<int32_t> owner;
+  /* Constructor that every END of a function follows, -1 if there is none */
+  std::vector<int32_t> returned;
+  /* Extra stack depth needed by a function for the fields of its tuples */
+  std::vector<int32_t> extra_depth;
+  int32_t replaced;
+
+  bool is_constructor(const instruction &i) {
+    return (i.op == BARRAY || i.op == SEXP) && i.a >= 1 && i.a <= MAX_FIELDS;
+  }
+
+  bool same_tag(const instruction &x, const instruction &y) {
+    return strcmp(prog->bf->get_string(x.ref), prog->bf->get_string(y.ref)) == 0;
+  }
+
+  bool same_shape(const instruction &x, const instruction &y) {
+    return x.op == y.op && x.a == y.a && (x.op == BARRAY || same_tag(x, y));
+  }
+
+  /* The shape test of the tuple built by `constructor` */
+  bool is_shape_test(const instruction &test, const instruction &constructor) {
+    if (constructor.op == BARRAY) {
+      return test.op == ARRAY && test.a == constructor.a;
+    }
+    return test.op == TAG && test.a == constructor.a && same_tag(test, constructor);
+  }
+
+  void find_functions() {
+    int32_t size = code.size();
+    owner.assign(size, -1);
+    returned.assign(size, -1);
+    extra_depth.assign(size, 0);
+
+    int32_t begin = -1;
+    for (int32_t k = 0; k < size; k++) {
+      if (code[k].op == BEGIN || code[k].op == CBEGIN) {
+        begin = k;
+      }
+      owner[k] = begin;
+    }
+
+    std::vector<bool> qualifies(size, true);
+    for (int32_t k = 0; k < size; k++) {
+      if (code[k].op != END || owner[k] < 0) {
+        continue;
+      }
+      int32_t f = owner[k];
+      if (targets[k] || k - 1 <= f || !is_constructor(code[k - 1])) {
+        qualifies[f] = false;
+      } else if (returned[f] < 0) {
+        returned[f] = k - 1;
+      } else if (!same_shape(code[returned[f]], code[k - 1])) {
+        qualifies[f] = false;
+      }
+    }
+    for (int32_t k = 0; k < size; k++) {
+      if (!qualifies[k] || code[k].op != BEGIN) {
+        returned[k] = -1;
+      }
+    }
+  }
+
+  /* Stack effect of an instruction that may work above the tuple */
+  bool effect(const instruction &i, int32_t &pops, int32_t &pushes) {
+    pushes = 1;
+    switch (i.op) {
+    case CONST:
+    case LD | LOC_GLOBAL:
+    case LD | LOC_LOCAL:
+    case LD | LOC_ARG:
+    case LD | LOC_CLOSURE:
+      pops = 0;
+      return true;
+    case ST | LOC_GLOBAL:
+    case ST | LOC_LOCAL:
+    case ST | LOC_ARG:
+    case ST | LOC_CLOSURE:
+    case TAG:
+    case ARRAY:
+    case LENGTH:
+    case WRITE:
+      pops = 1;
+      return true;
+    case DUP:
+      pops   = 1;
+      pushes = 2;
+      return true;
+    case DROP:
+      pops   = 1;
+      pushes = 0;
+      return true;
+    case ELEM:
+      pops = 2;
+      return true;
+    }
+    if (is_binop(i)) {
+      pops = 2;
+      return true;
+    }
+    if ((i.op & ~0x0F) == PATT) {
+      pops = (i.op & 0x0F) == 0 ? 2 : 1;
+      return true;
+    }
+    return false;
+  }
+
+  /* CONST with the index of a field of a tuple of n */
+  bool is_field(const instruction &i, int32_t n) {
+    return i.op == CONST && unbox(i.a) >= 0 && unbox(i.a) < n;
+  }
+
+  bool entered(int32_t k, int32_t length) {
+    for (int32_t j = k; j < k + length; j++) {
+      if (targets[j]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Rewrites the uses of the tuple built by `constructor` that is on top of
+   the stack before instruction `k`; returns false and leaves the code as it
+   was if the tuple escapes */
+  bool replace_uses(int32_t k, const instruction &constructor) {
+    int32_t n = constructor.a;
+    /* targets, owner and the rest cover the code as it was before the stubs */
+    int32_t end = std::min(k + MAX_SEQUENCE, static_cast<int32_t>(targets.size()));
+    std::vector<instruction> rewritten(code.begin() + k, code.begin() + end);
+    std::vector<int32_t> stubs;
+    int32_t above = 0;
+
+    auto set = [&rewritten, k](int32_t j, int32_t op, int32_t a) {
+      rewritten[j - k].op = op;
+      rewritten[j - k].a  = a;
+    };
+
+    /* Every step looks at most two instructions ahead */
+    for (int32_t j = k; ; ) {
+      if (j + 2 >= end || targets[j]) {
+        return false;
+      }
+      const instruction &i = code[j];
+
+      if (above == 0) {
+        if (i.op == DUP && !entered(j + 1, 2) && is_shape_test(code[j + 1], constructor)
+            && code[j + 2].op == CJMPZ) {
+          set(j, NOP, 0);
+          set(j + 1, NOP, 0);
+          set(j + 2, NOP, 0);
+          j += 3;
+        } else if (i.op == DUP && !entered(j + 1, 2) && is_field(code[j + 1], n)
+                   && code[j + 2].op == ELEM) {
+          set(j, PICK, n - 1 - unbox(code[j + 1].a));
+          set(j + 1, NOP, 0);
+          set(j + 2, NOP, 0);
+          above = 1;
+          j += 3;
+        } else if (is_field(i, n) && !entered(j + 1, 1) && code[j + 1].op == ELEM) {
+          set(j, PICK, n - 1 - unbox(i.a));
+          set(j + 1, SLIDE, n);
+          break;
+        } else if (i.op == DROP) {
+          set(j, DROP_N, n);
+          break;
+        } else {
+          return false;
+        }
+        continue;
+      }
+
+      /* The code at the target sees the tuple itself */
+      if (i.op == CJMPZ || i.op == CJMPNZ) {
+        if (above != 1) {
+          return false;
+        }
+        stubs.push_back(j);
+        above = 0;
+        j++;
+        continue;
+      }
+
+      int32_t pops, pushes;
+      if (!effect(i, pops, pushes) || pops > above) {
+        return false;
+      }
+      above += pushes - pops;
+      j++;
+    }
+
+    /* The stubs go after the end of the program, outside of any function: they
+       are only reached by the jumps above, and the scans of this pass stop at
+       the original size, so they are never rewritten themselves */
+    std::copy(rewritten.begin(), rewritten.end(), code.begin() + k);
+    for (int32_t j : stubs) {
+      int32_t target = code[j].ref;
+      code[j].ref = code.size();
+      instruction build = constructor;
+      code.push_back(build);
+      instruction jump;
+      jump.op  = JMP;
+      jump.a   = 0;
+      jump.b   = 0;
+      jump.ref = target;
+      code.push_back(jump);
+    }
+    return true;
+  }
+
+public:
+  scalar_replacement(program *prog): prog(prog), code(prog->code), targets(prog->branch_targets()),
+    replaced(0) {}
+
+  int32_t run() {
+    find_functions();
+    int32_t size = code.size();
+    std::vector<bool> unpacked(size, false);
+
+    for (int32_t k = 0; k + 1 < size; k++) {
+      instruction i = code[k];
+      int32_t f = owner[k];
+      if (f < 0) {
+        continue;
+      }
+      if (is_constructor(i) && code[k + 1].op != END) {
+        if (replace_uses(k + 1, i)) {
+          code[k].op = NOP;
+          extra_depth[f] = std::max(extra_depth[f], i.a - 1);
+          replaced++;
+        }
+      } else if (i.op == CALL && returned[i.ref] >= 0) {
+        instruction constructor = code[returned[i.ref]];
+        if (replace_uses(k + 1, constructor)) {
+          code[k].op = CALL_UNPACK;
+          unpacked[i.ref] = true;
+          extra_depth[f] = std::max(extra_depth[f], constructor.a - 1);
+          replaced++;
+        }
+      }
+    }
+
+    /* Callees of CALL_UNPACK return the fields */
+    for (int32_t k = 0; k < size; k++) {
+      if (code[k].op == END && owner[k] >= 0 && unpacked[owner[k]]) {
+        instruction &constructor = code[k - 1];
+        constructor.op = constructor.op == BARRAY ? BARRAY_END : SEXP_END;
+      }
+    }
+    for (int32_t k = 0; k < size; k++) {
+      if (extra_depth[k] > 0) {
+        code[k].depth += extra_depth[k];
+      }
+    }
+    return replaced;
+  }
+};
+
+int32_t replace_tuples(program *prog) {
+  int32_t replaced = scalar_replacement(prog).run();
+  prog->remove_nops();
+#ifdef STATS
+  fprintf(stderr, "scalar replacement: %d tuples kept on the stack\n", replaced);
+#endif
+  return replaced;
+}
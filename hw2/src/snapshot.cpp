@@ -0,0 +1,270 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "snapshot.h"
+#include "cache.h"
+
+extern "C" {
+  extern void* __gc_heap_used (size_t *bytes);
+  extern void* __gc_heap_load (size_t bytes);
+  extern void* __gc_singletons (size_t *bytes);
+  extern void* Barray_empty ();
+}
+
+/* The image holds the memory areas of the interpreter one after another, in
+   the order of area_kind, and the addresses they had. A word that is not a
+   boxed integer and points into one of the old areas is a pointer, and it
+   is moved along with the area. This is the same guess the GC makes about
+   the words on the stack; objects in the heap are reached from the globals
+   and the stack, so the headers and the bytes of strings are left alone. */
+
+/* Bump whenever the layout of the image, of the frames or of the heap changes */
+static const uint32_t VERSION = 2;
+static const char MAGIC[4] = {'L', 'I', 'M', 'G'};
+
+/* Frames have an extra word with TOS_CACHING */
+#ifdef TOS_CACHING
+static const uint32_t FRAME_LAYOUT = 1;
+#else
+static const uint32_t FRAME_LAYOUT = 0;
+#endif
+
+enum area_kind {
+  AREA_HEAP,          /* The used part of the from-space                    */
+  AREA_SINGLETONS,    /* The table of nullary S-expressions                 */
+  AREA_EMPTY_ARRAY,   /* The shared empty array, nothing is saved            */
+  AREA_CODE,          /* Instructions, nothing is saved                      */
+  AREA_GLOBALS,
+  AREA_STACK,         /* [bottom, top] of the operand stack                  */
+  AREAS_NUMBER
+};
+
+struct image_header {
+  char     magic[4];
+  uint32_t version;
+  uint32_t frame_layout;
+  uint32_t code;                    /* Number of instructions                 */
+  uint64_t key;                     /* See program_key()                      */
+  uint64_t begin[AREAS_NUMBER];     /* Addresses in the run that saved it     */
+  uint64_t size[AREAS_NUMBER];      /* Sizes in bytes                         */
+  uint64_t saved[AREAS_NUMBER];     /* Bytes of the area in the image         */
+  uint64_t ip;                      /* Index of the instruction to continue with */
+  uint64_t fp;
+};
+
+/* Where the areas are in this run */
+struct areas {
+  char   *begin[AREAS_NUMBER];
+  size_t  size[AREAS_NUMBER];
+};
+
+static bool image_name(char (&name)[PATH_MAX], const char *fname, const char *suffix) {
+  int length = snprintf(name, sizeof(name), "%s.image%s", fname, suffix);
+  return length > 0 && static_cast<size_t>(length) < sizeof(name);
+}
+
+static areas current_areas(program *prog, const machine_state &state) {
+  areas a;
+  a.begin[AREA_HEAP]        = static_cast<char*>(__gc_heap_used(&a.size[AREA_HEAP]));
+  a.begin[AREA_SINGLETONS]  = static_cast<char*>(__gc_singletons(&a.size[AREA_SINGLETONS]));
+  a.begin[AREA_EMPTY_ARRAY] = static_cast<char*>(Barray_empty());
+  a.size[AREA_EMPTY_ARRAY]  = 0;
+  a.begin[AREA_CODE]        = reinterpret_cast<char*>(prog->code.data());
+  a.size[AREA_CODE]         = prog->code.size() * sizeof(instruction);
+  a.begin[AREA_GLOBALS]     = reinterpret_cast<char*>(prog->bf->global_ptr);
+  a.size[AREA_GLOBALS]      = prog->bf->get_global_area_size() * sizeof(int32_t);
+  a.begin[AREA_STACK]       = reinterpret_cast<char*>(state.bottom);
+  a.size[AREA_STACK]        = (state.top + 1 - state.bottom) * sizeof(int32_t);
+  return a;
+}
+
+static bool is_saved(int kind) {
+  return kind != AREA_EMPTY_ARRAY && kind != AREA_CODE;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+  const char *from = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = write(fd, from, size);
+    if (written <= 0) {
+      return false;
+    }
+    from += written;
+    size -= written;
+  }
+  return true;
+}
+
+void save_snapshot(program *prog, const char *fname, const machine_state &state) {
+  char name[PATH_MAX], temporary[PATH_MAX], suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d", static_cast<int>(getpid()));
+  if (!image_name(name, fname, "") || !image_name(temporary, fname, suffix)) {
+    return;
+  }
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return;
+  }
+
+  areas a = current_areas(prog, state);
+  image_header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version      = VERSION;
+  header.frame_layout = FRAME_LAYOUT;
+  header.code         = prog->code.size();
+  header.key          = program_key(prog);
+  for (int k = 0; k < AREAS_NUMBER; k++) {
+    header.begin[k] = reinterpret_cast<uintptr_t>(a.begin[k]);
+    header.size[k]  = a.size[k];
+    header.saved[k] = is_saved(k) ? a.size[k] : 0;
+  }
+  header.ip = state.ip - prog->code.data();
+  header.fp = reinterpret_cast<uintptr_t>(state.fp);
+
+  bool written = write_all(fd, &header, sizeof(header));
+  for (int k = 0; k < AREAS_NUMBER && written; k++) {
+    written = write_all(fd, a.begin[k], header.saved[k]);
+  }
+  close(fd);
+  if (!written || rename(temporary, name) != 0) {
+    unlink(temporary);
+  }
+#ifdef STATS
+  fprintf(stderr, "snapshot: saved %zu bytes of heap at instruction %d\n", a.size[AREA_HEAP],
+          static_cast<int>(header.ip));
+#endif
+}
+
+class relocation {
+private:
+  const image_header &header;
+  const areas &now;
+
+public:
+  relocation(const image_header &header, const areas &now): header(header), now(now) {}
+
+  int32_t operator()(int32_t word) const {
+    if (word & 1) {
+      return word;
+    }
+    uint64_t address = static_cast<uint32_t>(word);
+    for (int k = 0; k < AREAS_NUMBER; k++) {
+      if (header.begin[k] <= address && address <= header.begin[k] + header.size[k]) {
+        return static_cast<int32_t>(reinterpret_cast<intptr_t>(now.begin[k] + (address - header.begin[k])));
+      }
+    }
+    return word;
+  }
+};
+
+/* Relocates the words of the globals and of the stack, and the fields of the
+   objects reachable from them */
+static void relocate(const image_header &header, const areas &now) {
+  relocation moved(header, now);
+  int32_t *heap = reinterpret_cast<int32_t*>(now.begin[AREA_HEAP]);
+  size_t heap_words = now.size[AREA_HEAP] / sizeof(int32_t);
+  std::vector<bool> visited(heap_words, false);
+  std::vector<int32_t*> objects;
+
+  auto relocate_word = [&](int32_t &word) {
+    word = moved(word);
+    int32_t *p = reinterpret_cast<int32_t*>(word);
+    if ((word & 1) || p <= heap || p >= heap + heap_words || visited[p - heap]) {
+      return;
+    }
+    visited[p - heap] = true;
+    objects.push_back(p);
+  };
+
+  for (int kind : {AREA_GLOBALS, AREA_STACK}) {
+    int32_t *words = reinterpret_cast<int32_t*>(now.begin[kind]);
+    for (size_t k = 0; k < now.size[kind] / sizeof(int32_t); k++) {
+      relocate_word(words[k]);
+    }
+  }
+
+  /* An object points to its fields, with the header in the word before */
+  while (!objects.empty()) {
+    int32_t *p = objects.back();
+    objects.pop_back();
+    int32_t header = p[-1];
+    if ((header & 7) == STRING_TAG) {
+      continue;
+    }
+    int32_t fields = static_cast<uint32_t>(header) >> 3;
+    for (int32_t k = 0; k < fields; k++) {
+      relocate_word(p[k]);
+    }
+  }
+}
+
+bool load_snapshot(program *prog, const char *fname, machine_state &state) {
+  char name[PATH_MAX];
+  if (!image_name(name, fname, "")) {
+    return false;
+  }
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(image_header)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  const char *data = static_cast<const char*>(mapped);
+  image_header header;
+  memcpy(&header, data, sizeof(header));
+  state.bottom = state.top;
+  areas now = current_areas(prog, state);
+
+  uint64_t saved = 0;
+  for (int k = 0; k < AREAS_NUMBER; k++) {
+    saved += header.saved[k];
+  }
+  size_t stack_words = header.size[AREA_STACK] / sizeof(int32_t);
+  bool valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+            && header.version == VERSION
+            && header.frame_layout == FRAME_LAYOUT
+            && header.code == prog->code.size()
+            && header.key == program_key(prog)
+            && header.size[AREA_SINGLETONS] == now.size[AREA_SINGLETONS]
+            && header.size[AREA_GLOBALS] == now.size[AREA_GLOBALS]
+            && header.ip < header.code
+            && stack_words >= 1
+            && stack_words <= static_cast<size_t>(state.top + 1 - state.limit)
+            && size - sizeof(header) == saved;
+  if (valid) {
+    state.bottom = state.top + 1 - stack_words;
+    now.begin[AREA_HEAP]  = static_cast<char*>(__gc_heap_load(header.size[AREA_HEAP]));
+    now.size[AREA_HEAP]   = header.size[AREA_HEAP];
+    now.begin[AREA_STACK] = reinterpret_cast<char*>(state.bottom);
+    now.size[AREA_STACK]  = header.size[AREA_STACK];
+
+    const char *from = data + sizeof(header);
+    for (int k = 0; k < AREAS_NUMBER; k++) {
+      memcpy(now.begin[k], from, header.saved[k]);
+      from += header.saved[k];
+    }
+    relocate(header, now);
+    relocation moved(header, now);
+    state.ip = prog->code.data() + header.ip;
+    state.fp = reinterpret_cast<int32_t*>(moved(static_cast<int32_t>(header.fp)));
+  }
+  munmap(mapped, size);
+#ifdef STATS
+  fprintf(stderr, "snapshot: %s\n", valid ? "resumed" : "no image for this program");
+#endif
+  return valid;
+}
@@ -0,0 +1,104 @@
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <algorithm>
+#include "stack.h"
+
+extern "C" {
+  #include "runtime.h"
+}
+
+/* The stack takes [base, end): the guard page at base is never accessible,
+   [base + page, committed) is reserved and [committed, end) is readable and
+   writable. A fault below committed commits at least as much again, so a deep
+   recursion takes a logarithmic number of faults.
+
+   The handler runs on its own signal stack and does nothing that is not
+   async-signal-safe: an overflow jumps back to run_guarded, which reports it
+   in the ordinary way. */
+
+static const size_t INITIAL_WORDS = 16 * 1024;
+
+static char *base      = nullptr;
+static char *committed = nullptr;
+static char *end       = nullptr;
+static size_t page     = 0;
+static struct sigaction previous;
+static stack_t previous_signal_stack;
+/* SIGSTKSZ is not a constant in newer glibc */
+static char signal_stack[64 * 1024];
+static sigjmp_buf *overflow = nullptr;
+
+static size_t round_up(size_t bytes) {
+  return (bytes + page - 1) / page * page;
+}
+
+static void on_fault(int, siginfo_t *info, void *) {
+  char *address = static_cast<char*>(info->si_addr);
+  if (address < base || address >= committed) {
+    /* Not the stack: the access faults again, now with the previous handler */
+    sigaction(SIGSEGV, &previous, nullptr);
+    return;
+  }
+  char *needed = base + (address - base) / page * page;
+  size_t grow = std::max<size_t>(end - committed, committed - needed);
+  grow = std::min<size_t>(grow, committed - (base + page));
+  if (address < base + page || mprotect(committed - grow, grow, PROT_READ | PROT_WRITE) != 0) {
+    if (overflow != nullptr) {
+      siglongjmp(*overflow, 1);
+    }
+    static const char message[] = "*** FAILURE: Stack limit exceeded";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    _exit(255);
+  }
+  committed -= grow;
+}
+
+int32_t *reserve_stack(size_t words) {
+  page = sysconf(_SC_PAGESIZE);
+  size_t bytes = round_up((words + 1) * sizeof(int32_t));
+  void *reserved = mmap(nullptr, page + bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    failure("ERROR: cannot reserve memory for the stack\n");
+  }
+  base = static_cast<char*>(reserved);
+  end  = base + page + bytes;
+
+  size_t initial = std::min(round_up(INITIAL_WORDS * sizeof(int32_t)), bytes);
+  committed = end - initial;
+  if (mprotect(committed, initial, PROT_READ | PROT_WRITE) != 0) {
+    failure("ERROR: cannot reserve memory for the stack\n");
+  }
+
+  stack_t signal_stack_area;
+  signal_stack_area.ss_sp    = signal_stack;
+  signal_stack_area.ss_size  = sizeof(signal_stack);
+  signal_stack_area.ss_flags = 0;
+  sigaltstack(&signal_stack_area, &previous_signal_stack);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = on_fault;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previous);
+  return reinterpret_cast<int32_t*>(end) - 1;
+}
+
+void run_guarded(void (*body)(void*), void *argument) {
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 1) != 0) {
+    overflow = nullptr;
+    failure("Stack limit exceeded");
+  }
+  overflow = &jump;
+  body(argument);
+  overflow = nullptr;
+}
+
+void release_stack() {
+  sigaction(SIGSEGV, &previous, nullptr);
+  sigaltstack(&previous_signal_stack, nullptr);
+  munmap(base, end - base);
+  base = committed = end = nullptr;
+}
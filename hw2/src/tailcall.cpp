@@ -0,0 +1,16 @@
+#include "tailcall.h"
+
+void mark_tail_calls(program *prog) {
+  /* END stays in place: other paths may still jump to it */
+  for (size_t k = 0; k + 1 < prog->code.size(); k++) {
+    instruction &i = prog->code[k];
+    if (prog->code[k + 1].op != END) {
+      continue;
+    }
+    if (i.op == CALL) {
+      i.op = TAIL_CALL;
+    } else if (i.op == CALLC) {
+      i.op = TAIL_CALLC;
+    }
+  }
+}
@@ -0,0 +1,301 @@
+#include <utility>
+#include "verifier.h"
+
+/* What the verifier knows about a value on the operand stack. STA pops two
+   values when its index is an address pushed by LDA and three otherwise. */
+enum slot_kind : char {
+  SLOT_VALUE,
+  SLOT_ADDRESS,
+  SLOT_UNKNOWN   /* A value on some paths and an address on others */
+};
+
+/* Kinds of the values on the operand stack of a frame, bottom first */
+typedef std::vector<char> stack_state;
+
+static void reject(program *prog, int32_t k, const char *what) {
+  failure("ERROR: %s at instruction %d (line %d)\n", what, k, prog->get_line(&prog->code[k]));
+}
+
+static bool is_function(const instruction &i) {
+  return i.op == BEGIN || i.op == CBEGIN;
+}
+
+/* Merges `state` into the state already recorded at a branch target; returns
+   whether the recorded state changed */
+static bool merge(program *prog, int32_t k, stack_state &recorded, const stack_state &state) {
+  if (recorded.size() != state.size()) {
+    reject(prog, k, "inconsistent operand stack depth");
+  }
+  bool changed = false;
+  for (size_t n = 0; n < state.size(); n++) {
+    if (recorded[n] != state[n] && recorded[n] != SLOT_UNKNOWN) {
+      recorded[n] = SLOT_UNKNOWN;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/* Abstract interpretation of the function starting at `begin`. A function must
+   not leave the code between its BEGIN and the next one (`enclosing` maps every
+   instruction to the closest BEGIN before it): argument indices are decoded
+   relative to that BEGIN. `captures` is the number of captured values every
+   closure of the function has. `owner` marks reached instructions, `states`
+   keeps the operand stack at branch targets. */
+static void verify_function(program *prog, int32_t begin, const std::vector<bool> &targets,
+                            const std::vector<int32_t> &enclosing, const std::vector<int32_t> &captures,
+                            std::vector<int32_t> &owner,
+                            std::vector<stack_state> &states, std::vector<int32_t> &depth) {
+  instruction &function = prog->code[begin];
+  int32_t nargs   = function.a;
+  int32_t nlocals = function.b;
+  size_t  max_depth = 0;
+
+  if (nargs < 0 || nlocals < 0) {
+    reject(prog, begin, "invalid BEGIN");
+  }
+  owner[begin] = begin;
+
+  std::vector<std::pair<int32_t, stack_state>> worklist;
+  worklist.push_back(std::make_pair(begin + 1, stack_state()));
+
+  while (!worklist.empty()) {
+    int32_t     k     = worklist.back().first;
+    stack_state state = std::move(worklist.back().second);
+    worklist.pop_back();
+
+    auto pop = [prog, &k, &state](int32_t n) {
+      if (n < 0) {
+        reject(prog, k, "invalid operand count");
+      }
+      if (state.size() < static_cast<size_t>(n)) {
+        reject(prog, k, "operand stack underflow");
+      }
+      state.resize(state.size() - n);
+    };
+
+    auto peek = [prog, &k, &state](size_t n) {
+      if (state.size() <= n) {
+        reject(prog, k, "operand stack underflow");
+      }
+      return state[state.size() - n - 1];
+    };
+
+    auto push = [&state, &max_depth](char kind) {
+      state.push_back(kind);
+      if (state.size() > max_depth) {
+        max_depth = state.size();
+      }
+    };
+
+    auto check_location = [prog, &k, nargs, nlocals, &captures, begin](int32_t kind, int32_t index) {
+      bool valid = index >= 0;
+      switch (kind) {
+        case LOC_GLOBAL:  valid = valid && index < prog->bf->get_global_area_size(); break;
+        case LOC_LOCAL:   valid = valid && index < nlocals; break;
+        case LOC_ARG:     valid = valid && index < nargs; break;
+        case LOC_CLOSURE: valid = valid && index < captures[begin]; break;
+        default:          reject(prog, k, "invalid variable kind");
+      }
+      if (!valid) {
+        reject(prog, k, "variable index out of range");
+      }
+    };
+
+    bool reachable = true;
+    while (reachable) {
+      if (enclosing[k] != begin) {
+        reject(prog, k, "control leaves the function");
+      }
+      if (targets[k]) {
+        if (owner[k] == begin) {
+          if (!merge(prog, k, states[k], state)) {
+            break;
+          }
+          state = states[k];
+        } else {
+          states[k] = state;
+        }
+      }
+      owner[k] = begin;
+      depth[k] = state.size();
+
+      const instruction &i = prog->code[k];
+      int32_t next = k + 1;
+
+      switch (i.op & ~0x0F) {
+      case BINOP:
+        pop(2);
+        push(SLOT_VALUE);
+        break;
+
+      case LD:
+        check_location(i.op & 0x0F, i.a);
+        push(SLOT_VALUE);
+        break;
+
+      case LDA:
+        check_location(i.op & 0x0F, i.a);
+        push(SLOT_ADDRESS);
+        break;
+
+      case ST:
+        check_location(i.op & 0x0F, i.a);
+        peek(0);
+        break;
+
+      case PATT:
+        pop(i.op == PATT ? 2 : 1);
+        push(SLOT_VALUE);
+        break;
+
+      default:
+        switch (i.op) {
+        case CONST:
+        case STRING:
+        case READ:
+          push(SLOT_VALUE);
+          break;
+
+        case CALL:
+          if (i.a != prog->code[i.ref].a) {
+            reject(prog, k, "wrong number of arguments");
+          }
+          pop(i.a);
+          push(SLOT_VALUE);
+          break;
+
+        case SEXP:
+        case BARRAY:
+          pop(i.a);
+          push(SLOT_VALUE);
+          break;
+
+        case CALLC:
+          pop(i.a);
+          pop(1);
+          push(SLOT_VALUE);
+          break;
+
+        case STA:
+          if (peek(1) == SLOT_UNKNOWN) {
+            reject(prog, k, "STA with an ambiguous destination");
+          }
+          pop(peek(1) == SLOT_ADDRESS ? 2 : 3);
+          push(SLOT_VALUE);
+          break;
+
+        case ELEM:
+          pop(2);
+          push(SLOT_VALUE);
+          break;
+
+        case DROP:
+          pop(1);
+          break;
+
+        case DUP:
+          push(peek(0));
+          break;
+
+        case TAG:
+        case ARRAY:
+        case WRITE:
+        case LENGTH:
+        case LSTRING:
+          pop(1);
+          push(SLOT_VALUE);
+          break;
+
+        case CLOSURE:
+          if (i.a < 0) {
+            reject(prog, k, "invalid operand count");
+          }
+          for (int32_t m = 0; m < i.a; m++) {
+            check_location(prog->binds[i.b + m].kind, prog->binds[i.b + m].index);
+          }
+          push(SLOT_VALUE);
+          break;
+
+        case JMP:
+          next = i.ref;
+          break;
+
+        case CJMPZ:
+        case CJMPNZ:
+          pop(1);
+          worklist.push_back(std::make_pair(i.ref, state));
+          break;
+
+        case END:
+          pop(1);
+          reachable = false;
+          break;
+
+        /* These stop the program */
+        case FAIL:
+        case STI:
+        case RET:
+        case SWAP:
+        case STOP:
+          reachable = false;
+          break;
+
+        case BEGIN:
+        case CBEGIN:
+          reject(prog, k, "control reaches BEGIN");
+          break;
+
+        default:
+          reject(prog, k, "unexpected instruction");
+        }
+      }
+      k = next;
+    }
+  }
+
+  function.depth = max_depth;
+}
+
+std::vector<int32_t> verify(program *prog) {
+  std::vector<bool>        targets = prog->branch_targets();
+  std::vector<int32_t>     depth(prog->code.size(), -1);
+  std::vector<int32_t>     owner(prog->code.size(), -1);
+  std::vector<stack_state> states(prog->code.size());
+  std::vector<int32_t>     enclosing(prog->code.size(), -1);
+
+  int32_t last = -1;
+  for (size_t k = 0; k < prog->code.size(); k++) {
+    if (is_function(prog->code[k])) {
+      last = k;
+    }
+    enclosing[k] = last;
+  }
+
+  /* A function may read as many captured values as its smallest CLOSURE
+     site binds; a function that is called directly or is the entry point has
+     no closure to read them from */
+  std::vector<int32_t> functions;
+  std::vector<int32_t> captures(prog->code.size(), -1);
+  functions.push_back(0);
+  captures[0] = 0;
+  for (const instruction &i : prog->code) {
+    if (i.op == CALL || i.op == CLOSURE) {
+      int32_t bound = i.op == CLOSURE ? i.a : 0;
+      if (captures[i.ref] == -1 || bound < captures[i.ref]) {
+        captures[i.ref] = bound;
+      }
+      functions.push_back(i.ref);
+    }
+  }
+
+  for (int32_t begin : functions) {
+    if (!is_function(prog->code[begin])) {
+      reject(prog, begin, "call of a non-function");
+    }
+    if (owner[begin] == -1) {
+      verify_function(prog, begin, targets, enclosing, captures, owner, states, depth);
+    }
+  }
+  return depth;
+}
@@ -9,13 +9,13 @@
 # include <stdarg.h>
 # include "byterun.h"
 
-static void vfailure (char *s, va_list args) {
+static void __attribute__ ((noreturn)) vfailure (const char *s, va_list args) {
   fprintf(stderr, "*** FAILURE: ");
   vfprintf(stderr, s, args);   // vprintf (char *, va_list) <-> printf (char *, ...)
   exit(255);
 }
 
-void failure (char *s, ...) {
+void failure (const char *s, ...) {
   va_list args;
 
   va_start(args, s);
@@ -39,38 +39,13 @@ int get_public_offset (bytefile *f, int i) {
 
 /* Reads a binary bytecode file by name and unpacks it */
 bytefile* read_file (char *fname) {
-  FILE *f = fopen (fname, "rb");
-  long size;
-  bytefile *file;
-
-  if (f == 0) {
-    failure ("%s\n", strerror (errno));
-  }
-  
-  if (fseek (f, 0, SEEK_END) == -1) {
-    failure ("%s\n", strerror (errno));
-  }
-
-  file = (bytefile*) malloc (sizeof(int32_t)*5 + (size = ftell (f)));
+  bytefile *file = (bytefile*) malloc (sizeof(bytefile));
 
   if (file == 0) {
     failure ("unable to allocate memory.\n");
   }
-  
-  rewind (f);
-
-  if (size != fread (&file->stringtab_size, 1, size, f)) {
-    failure ("%s\n", strerror (errno));
-  }
-  
-  fclose (f);
-  
-  file->string_ptr    = &file->buffer [file->public_symbols_number * 2 * sizeof(int)];
-  file->public_ptr    = (int32_t*) file->buffer;
-  file->code_ptr      = &file->string_ptr [file->stringtab_size];
-  file->global_ptr    = (int32_t*) malloc (file->global_area_size * sizeof (int));
-  file->bytecode_size = (char*) &file->stringtab_size + size - file->code_ptr;
 
+  map_bytefile (fname, file);
   return file;
 }
 
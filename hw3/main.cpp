@@ -35,7 +35,7 @@ void eval_counter(FILE *f, bytefile *bf) {
     std::unordered_map<code_instruction, int> counter;
     const char *ip = bf->code_ptr;
 
-    while (ip < bf->code_ptr + bf->bytecode_size) {
+    while (ip < bf->code_ptr + bf->code_size) {
         const char *new_ip = disassemble_one_instruction(nullptr, bf, ip);
         ++counter[code_instruction(ip, new_ip - ip)];
         ip = new_ip;